@@ -0,0 +1,213 @@
+// Searches the game archive that chess_algorithm.c writes (see DECLARATIONS FOR THE GAME ARCHIVE)
+// Build and run from the repository root:
+//     gcc -O2 -o archive_query archive_query.c -lm
+//     ./archive_query archive index          sorts the positions logged since the last run into positions.idx
+//     ./archive_query archive find FEN       lists every archived game that reached the position
+//     ./archive_query archive show GAME      prints a game's moves
+// Positions logged since the index was last built are still found (by scanning them), so "index" only needs running now and then.
+
+#include "chess_algorithm.c"
+
+#define INDEX_MAGIC "CHESSIX1"
+#define MAX_MATCHES_SHOWN 50
+
+// positions.idx: this header, then archive_positions sorted by key (then game and ply)
+struct index_header {
+    char magic [8];
+    uint64_t numEntries;
+    uint64_t logEntries; // How many positions.log entries the index covers, from the start of the log
+};
+
+char archiveDirectory [256];
+
+// Maps a file of the archive read-only; returns NULL if it is missing or empty
+void *map_archive_file(char *name, size_t *size) {
+    char path [512];
+    snprintf(path, sizeof(path), "%s/%s", archiveDirectory, name);
+    *size = 0;
+    int fd = open(path, O_RDONLY);
+    if(fd == -1) return NULL;
+
+    struct stat info;
+    void *data = NULL;
+    if(fstat(fd, &info) == 0 && info.st_size > 0) {
+        data = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if(data == MAP_FAILED) data = NULL;
+        else *size = info.st_size;
+    }
+    close(fd);
+    return data;
+}
+
+int compare_positions(const void *a, const void *b) {
+    const struct archive_position *x = a, *y = b;
+    if(x->key != y->key) return x->key < y->key ? -1 : 1;
+    if(x->game != y->game) return x->game < y->game ? -1 : 1;
+    return (int) x->ply - (int) y->ply;
+}
+
+// Index and log, as mapped by open_index()
+struct archive_position *indexed = NULL;
+uint64_t numIndexed = 0;
+struct archive_position *logged = NULL;
+uint64_t numLogged = 0;
+uint64_t numCovered = 0; // Log entries already in the index
+
+void open_index() {
+    size_t size;
+    struct index_header *header = map_archive_file("positions.idx", &size);
+    if(header != NULL && size >= sizeof(*header) && !memcmp(header->magic, INDEX_MAGIC, 8)
+            && size == sizeof(*header) + header->numEntries * sizeof(struct archive_position)) {
+        indexed = (struct archive_position *) (header + 1);
+        numIndexed = header->numEntries;
+        numCovered = header->logEntries;
+    } else if(header != NULL) printf("[ARCHIVE] Ignoring positions.idx, it doesn't look like an index\n");
+
+    logged = map_archive_file("positions.log", &size);
+    numLogged = size / sizeof(struct archive_position);
+    if(numCovered > numLogged) { // Log was replaced since the index was built
+        printf("[ARCHIVE] positions.idx is out of date, run \"index\"\n");
+        indexed = NULL;
+        numIndexed = numCovered = 0;
+    }
+}
+
+// Merges the positions logged since the last run into the index
+int build_index() {
+    open_index();
+    uint64_t numNew = numLogged - numCovered;
+    struct archive_position *fresh = malloc((numNew + 1) * sizeof(*fresh));
+    memcpy(fresh, logged + numCovered, numNew * sizeof(*fresh));
+    long long start = trace_now();
+    qsort(fresh, numNew, sizeof(*fresh), compare_positions);
+
+    char path [512], temporary [512];
+    snprintf(path, sizeof(path), "%s/positions.idx", archiveDirectory);
+    snprintf(temporary, sizeof(temporary), "%s/positions.idx.tmp", archiveDirectory);
+    FILE *out = fopen(temporary, "wb");
+    if(out == NULL) {
+        printf("[ARCHIVE] Can't write %s\n", temporary);
+        return 1;
+    }
+    struct index_header header = {INDEX_MAGIC, numIndexed + numNew, numLogged};
+    fwrite(&header, sizeof(header), 1, out);
+    uint64_t a = 0, b = 0;
+    while(a < numIndexed || b < numNew) {
+        if(b == numNew || (a < numIndexed && compare_positions(&indexed[a], &fresh[b]) <= 0)) fwrite(&indexed[a++], sizeof(*fresh), 1, out);
+        else fwrite(&fresh[b++], sizeof(*fresh), 1, out);
+    }
+    bool written = !ferror(out);
+    if(fclose(out) != 0 || !written || rename(temporary, path) != 0) {
+        printf("[ARCHIVE] Can't write %s\n", path);
+        return 1;
+    }
+    free(fresh);
+    printf("[ARCHIVE] Indexed %llu new positions, %llu in total (%.2fs)\n", (unsigned long long) numNew,
+        (unsigned long long) header.numEntries, (trace_now() - start) / 1e9);
+    return 0;
+}
+
+// Reads a game's header, and optionally its FEN and moves; returns false if its record hasn't been written
+bool read_game(uint32_t game, struct archive_game_header *header, char *fen, uint16_t *moves) {
+    size_t offsetsSize, gamesSize;
+    uint64_t *offsets = map_archive_file("games.off", &offsetsSize);
+    char *games = map_archive_file("games.bin", &gamesSize);
+    bool found = offsets != NULL && games != NULL && game < offsetsSize / sizeof(uint64_t) && offsets[game] != ARCHIVE_NO_RECORD
+        && offsets[game] + sizeof(*header) <= gamesSize;
+    if(found) {
+        char *record = games + offsets[game];
+        memcpy(header, record, sizeof(*header));
+        if(fen != NULL) {
+            memcpy(fen, record + sizeof(*header), header->fenLength);
+            fen[header->fenLength] = '\0';
+        }
+        if(moves != NULL) memcpy(moves, record + sizeof(*header) + header->fenLength, header->numPlies * sizeof(uint16_t));
+    }
+    if(offsets != NULL) munmap(offsets, offsetsSize);
+    if(games != NULL) munmap(games, gamesSize);
+    return found;
+}
+
+const char *RESULTS [] = {"unfinished", "1-0", "0-1", "1/2-1/2"};
+
+void print_match(struct archive_position *match) {
+    struct archive_game_header header;
+    if(!read_game(match->game, &header, NULL, NULL)) {
+        printf("game %u, ply %u (still being played, or its board stopped before it was written)\n", match->game, match->ply);
+        return;
+    }
+    char started [32];
+    time_t startTime = header.startTime;
+    strftime(started, sizeof(started), "%Y-%m-%d %H:%M", localtime(&startTime));
+    printf("game %u, ply %u of %u, %s, %s\n", match->game, match->ply, header.numPlies, RESULTS[header.result & 3], started);
+}
+
+// Lists every game that reached the position given as a FEN (side to move, castling rights and en passant square count)
+int find_position(char *fen) {
+    if(!load_fen(fen)) {
+        printf("[ARCHIVE] Can't parse FEN \"%s\"\n", fen);
+        return 1;
+    }
+    uint64_t key = position_key();
+    open_index();
+
+    long long start = trace_now();
+    struct archive_position *matches [MAX_MATCHES_SHOWN];
+    uint64_t numMatches = 0;
+    uint64_t low = 0, high = numIndexed; // First entry with this key
+    while(low < high) {
+        uint64_t middle = (low + high) / 2;
+        if(indexed[middle].key < key) low = middle + 1;
+        else high = middle;
+    }
+    for(uint64_t i = low; i < numIndexed && indexed[i].key == key; i++) {
+        if(numMatches < MAX_MATCHES_SHOWN) matches[numMatches] = &indexed[i];
+        numMatches++;
+    }
+    for(uint64_t i = numCovered; i < numLogged; i++) { // Not indexed yet
+        if(logged[i].key != key) continue;
+        if(numMatches < MAX_MATCHES_SHOWN) matches[numMatches] = &logged[i];
+        numMatches++;
+    }
+    double milliseconds = (trace_now() - start) / 1e6;
+
+    for(uint64_t i = 0; i < numMatches && i < MAX_MATCHES_SHOWN; i++) print_match(matches[i]);
+    if(numMatches > MAX_MATCHES_SHOWN) printf("... and %llu more\n", (unsigned long long) (numMatches - MAX_MATCHES_SHOWN));
+    printf("[ARCHIVE] %llu matches for key %016llx in %.3fms (%llu indexed positions, %llu not indexed yet)\n", (unsigned long long) numMatches,
+        (unsigned long long) key, milliseconds, (unsigned long long) numIndexed, (unsigned long long) (numLogged - numCovered));
+    return 0;
+}
+
+int show_game(uint32_t game) {
+    struct archive_game_header header;
+    char fen [256];
+    uint16_t moves [ARCHIVE_MAX_PLIES];
+    if(!read_game(game, &header, fen, moves)) {
+        printf("[ARCHIVE] No record of game %u\n", game);
+        return 1;
+    }
+    printf("Game %u, %s, from %s\n", game, RESULTS[header.result & 3], header.fenLength > 0 ? fen : "the starting position");
+    for(int ply = 0; ply < header.numPlies; ply++) {
+        int src = ARCHIVE_MOVE_SRC(moves[ply]), dest = ARCHIVE_MOVE_DEST(moves[ply]), promotion = ARCHIVE_MOVE_PROMOTION(moves[ply]);
+        if(ply % 2 == 0) printf("%d. ", ply / 2 + 1);
+        printf("%c%c%c%c", 'a' + src % 8, '1' + src / 8, 'a' + dest % 8, '1' + dest / 8);
+        if(promotion != 0) printf("%c", "pnbrqk"[promotion]);
+        printf(ply % 2 == 1 || ply == header.numPlies - 1 ? "\n" : " ");
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if(argc < 3 || (strcmp(argv[2], "index") && argc < 4)) {
+        printf("Usage: %s DIRECTORY index | find FEN | show GAME\n", argv[0]);
+        return 2;
+    }
+    snprintf(archiveDirectory, sizeof(archiveDirectory), "%s", argv[1]);
+    set_debug_logging(false);
+
+    if(!strcmp(argv[2], "index")) return build_index();
+    if(!strcmp(argv[2], "find")) return find_position(argv[3]);
+    if(!strcmp(argv[2], "show")) return show_game(atoi(argv[3]));
+    printf("Unknown command \"%s\"\n", argv[2]);
+    return 2;
+}
@@ -0,0 +1,334 @@
+// Microbenchmarks for the rules engine, the speech parser and the motor path planner.
+// Every benchmark runs over a fixed set of positions, so numbers are comparable between commits.
+//
+// Build and run from the repository root:
+//     gcc -O2 -o bench bench.c -lm
+//     ./bench bench_results.json [label]
+// Then compare two runs with:
+//     python3 bench_compare.py old.json new.json
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+// Count heap allocations made by the library while a benchmark is running
+long long allocationCount = 0;
+void *bench_malloc(size_t size) { allocationCount++; return malloc(size); }
+void *bench_calloc(size_t n, size_t size) { allocationCount++; return calloc(n, size); }
+void *bench_realloc(void *p, size_t size) { allocationCount++; return realloc(p, size); }
+#define malloc(size) bench_malloc(size)
+#define calloc(n, size) bench_calloc(n, size)
+#define realloc(p, size) bench_realloc(p, size)
+
+#include "chess_algorithm.c"
+
+#undef malloc
+#undef calloc
+#undef realloc
+
+// Number of timed samples per benchmark; variance is reported across samples
+#define SAMPLES 15
+// Each sample repeats the benchmark body until it takes at least this long
+#define MIN_SAMPLE_NS 20000000LL
+
+// Rules engine positions, chosen to cover opening congestion, open middlegames and sparse endgames
+const char *POSITIONS [] = {
+    "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1", // Start
+    "r1bqkb1r/pppp1ppp/2n2n2/4p3/2B1P3/5N2/PPPP1PPP/RNBQK2R w KQkq - 4 4", // Italian
+    "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1", // Crowded middlegame, both sides can castle
+    "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1", // Rook endgame
+    "8/8/8/4k3/8/8/3QK3/8 b - - 0 1", // KQK
+};
+#define NUM_POSITIONS ((int) (sizeof(POSITIONS) / sizeof(POSITIONS[0])))
+
+// Recorded speech-to-text output, including the usual misrecognitions
+const char *TRANSCRIPTS [] = {
+    "Pawn eggplant 2 eggplant 4.",
+    "Pond donut seven donut five",
+    "Knight garlic one falafel three.",
+    "Horse banana 8 cash 6",
+    "Bishop falafel one cash four",
+    "Queen donut won hazelnut five.",
+    "Rook apple one to donut one",
+    "King castle",
+    "Queen castle.",
+    "Pawn eggplant seven eggplant ate queen",
+    "Night garlic for hazelnut stick",
+    "I think I will move my pawn to eggplant four please",
+};
+#define NUM_TRANSCRIPTS ((int) (sizeof(TRANSCRIPTS) / sizeof(TRANSCRIPTS[0])))
+
+// Physical layouts for the planner: a position, how many captured pieces already fill the perimeter, and a move in 10x10 coordinates
+struct planner_layout {
+    const char *name;
+    const char *fen;
+    int captured;
+    int srcRow, srcCol, destRow, destCol;
+};
+
+const struct planner_layout LAYOUTS [] = {
+    {"knight_out_start", "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1", 0, 1, 2, 3, 3},
+    {"knight_out_crowded", "r1bqkb1r/pppp1ppp/2n2n2/4p3/2B1P3/5N2/PPPP1PPP/RNBQK2R w KQkq - 4 4", 6, 1, 2, 3, 3},
+    {"deposit_full_perimeter", "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1", 20, 4, 5, 0, 5},
+    {"castle_king_route", "r3k2r/pppppppp/8/8/8/8/PPPPPPPP/R3K2R w KQkq - 0 1", 0, 1, 5, 1, 3},
+};
+#define NUM_LAYOUTS ((int) (sizeof(LAYOUTS) / sizeof(LAYOUTS[0])))
+
+struct bench_result {
+    const char *name;
+    long long opsPerSample;
+    double nsPerOp [SAMPLES];
+    double allocsPerOp;
+};
+
+struct bench_result results [32];
+int numResults = 0;
+
+long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Keeps the optimiser from discarding benchmark bodies whose results are otherwise unused
+volatile long long sink = 0;
+
+void place_captured(int count) {
+    for(int i = 0; i < count; i++) {
+        int spot = first_empty_spot(i % 2 == 0);
+        board[spot / BOARD_SIZE][spot % BOARD_SIZE] = (i % 2 == 0 ? &BLACK_PAWN : &WHITE_PAWN);
+    }
+}
+
+// Each benchmark body performs a fixed amount of work and returns how many operations that was
+long long bench_legal_move() {
+    long long ops = 0;
+    for(int p = 0; p < NUM_POSITIONS; p++) {
+        load_fen((char *) POSITIONS[p]);
+        for(int src = 0; src < 64; src++) {
+            if(piece_equal(board[BOARD_START + src / 8][BOARD_START + src % 8], &NULL_PIECE)) continue;
+            for(int dest = 0; dest < 64; dest++) {
+                sink += legal_move(src / 8, src % 8, dest / 8, dest % 8);
+                ops++;
+            }
+        }
+    }
+    return ops;
+}
+
+long long bench_tile_attacked() {
+    long long ops = 0;
+    for(int p = 0; p < NUM_POSITIONS; p++) {
+        load_fen((char *) POSITIONS[p]);
+        for(int tile = 0; tile < 64; tile++) {
+            sink += tile_attacked(tile / 8, tile % 8, WHITE) + tile_attacked(tile / 8, tile % 8, BLACK);
+            ops += 2;
+        }
+    }
+    return ops;
+}
+
+long long bench_has_valid_move() {
+    for(int p = 0; p < NUM_POSITIONS; p++) {
+        load_fen((char *) POSITIONS[p]);
+        sink += has_valid_move(turn);
+    }
+    return NUM_POSITIONS;
+}
+
+long long bench_analyze_board() {
+    for(int p = 0; p < NUM_POSITIONS; p++) {
+        load_fen((char *) POSITIONS[p]);
+        sink += analyze_board(other_colour(turn));
+    }
+    return NUM_POSITIONS;
+}
+
+// Every piece type to every square, as when the player leaves out the source and validate_move() has to find it
+long long bench_find_move_sources() {
+    int sources [16];
+    for(int p = 0; p < NUM_POSITIONS; p++) {
+        load_fen((char *) POSITIONS[p]);
+        for(int square = 0; square < 64; square++) {
+            for(int pieceId = PAWN_ID; pieceId <= KING_ID; pieceId++) sink += find_move_sources(pieceId, turn, square / 8, square % 8, sources);
+        }
+    }
+    return NUM_POSITIONS * 64 * 6;
+}
+
+// Endgames with few enough pieces for the tables, needs tables generated into tablebases/ (see tablebase_gen.c)
+const char *ENDGAMES [] = {
+    "8/8/8/4k3/8/8/8/KQ6 w - - 0 1",
+    "8/8/2k5/8/8/3K4/8/6R1 b - - 0 1",
+    "8/8/8/8/3k4/8/4P3/4K3 w - - 0 1",
+    "8/8/8/3k4/8/8/8/KBN5 w - - 0 1",
+};
+#define NUM_ENDGAMES ((int) (sizeof(ENDGAMES) / sizeof(ENDGAMES[0])))
+
+long long bench_tablebase_probe() {
+    for(int p = 0; p < NUM_ENDGAMES; p++) {
+        load_fen((char *) ENDGAMES[p]);
+        for(int i = 0; i < 64; i++) sink += tablebase_probe();
+    }
+    return NUM_ENDGAMES * 64;
+}
+
+long long bench_understand() {
+    char input [128], parsed [16];
+    for(int t = 0; t < NUM_TRANSCRIPTS; t++) {
+        strcpy(input, TRANSCRIPTS[t]); // understand() lowercases its input in place
+        understand(parsed, input);
+        sink += parsed[0];
+    }
+    return NUM_TRANSCRIPTS;
+}
+
+void setup_layout(const struct planner_layout *layout) {
+    load_fen((char *) layout->fen);
+    place_captured(layout->captured);
+    clone_board();
+    numCommandsInQueue = 0;
+    motorRow = motorCol = 0;
+}
+
+long long bench_min_disruption() {
+    for(int l = 0; l < NUM_LAYOUTS; l++) {
+        setup_layout(&LAYOUTS[l]);
+        bool path [BOARD_SIZE][BOARD_SIZE] = {0};
+        int paths [BOARD_SIZE * BOARD_SIZE] = {0};
+        sink += min_disruption((bool *) path, paths, LAYOUTS[l].srcRow, LAYOUTS[l].srcCol, LAYOUTS[l].destRow, LAYOUTS[l].destCol);
+    }
+    return NUM_LAYOUTS;
+}
+
+long long bench_corridor_route() {
+    int route [LATTICE_NODES];
+    float risk;
+    for(int l = 0; l < NUM_LAYOUTS; l++) {
+        setup_layout(&LAYOUTS[l]);
+        sink += corridor_route(route, LAYOUTS[l].srcRow * BOARD_SIZE + LAYOUTS[l].srcCol, LAYOUTS[l].destRow * BOARD_SIZE + LAYOUTS[l].destCol, &risk);
+    }
+    return NUM_LAYOUTS;
+}
+
+// Full plan through motor_instruct(): direct, corridor and evacuation (clear_path()) candidates, cheapest one queued
+long long bench_motor_instruct() {
+    set_plan_cache(false);
+    for(int l = 0; l < NUM_LAYOUTS; l++) {
+        setup_layout(&LAYOUTS[l]);
+        motor_instruct(LAYOUTS[l].srcRow, LAYOUTS[l].srcCol, LAYOUTS[l].destRow, LAYOUTS[l].destCol);
+        sink += numCommandsInQueue;
+    }
+    set_plan_cache(true);
+    return NUM_LAYOUTS;
+}
+
+// Same layouts again, served from the plan cache after the first sample
+long long bench_plan_cache_hit() {
+    for(int l = 0; l < NUM_LAYOUTS; l++) {
+        setup_layout(&LAYOUTS[l]);
+        motor_instruct(LAYOUTS[l].srcRow, LAYOUTS[l].srcCol, LAYOUTS[l].destRow, LAYOUTS[l].destCol);
+        sink += numCommandsInQueue;
+    }
+    return NUM_LAYOUTS;
+}
+
+// Where the carriage waits for the next move, from the corner, in every position
+long long bench_park_carriage() {
+    for(int p = 0; p < NUM_POSITIONS; p++) {
+        load_fen((char *) POSITIONS[p]);
+        numCommandsInQueue = 0;
+        motorRow = motorCol = 0;
+        park_carriage();
+        sink += numCommandsInQueue;
+    }
+    return NUM_POSITIONS;
+}
+
+void run_bench(const char *name, long long (*body)()) {
+    struct bench_result *result = &results[numResults++];
+    result->name = name;
+
+    // Warm up, and find how many repetitions make a sample long enough to time reliably
+    long long reps = 1;
+    while(true) {
+        long long start = now_ns();
+        for(long long r = 0; r < reps; r++) body();
+        if(now_ns() - start >= MIN_SAMPLE_NS || reps >= (1LL << 30)) break;
+        reps *= 2;
+    }
+
+    long long allocationsBefore = allocationCount;
+    long long ops = 0;
+    for(int s = 0; s < SAMPLES; s++) {
+        ops = 0;
+        long long start = now_ns();
+        for(long long r = 0; r < reps; r++) ops += body();
+        result->nsPerOp[s] = (double) (now_ns() - start) / ops;
+    }
+    result->opsPerSample = ops;
+    result->allocsPerOp = (double) (allocationCount - allocationsBefore) / ((double) ops * SAMPLES);
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+void summarise(struct bench_result *result, double *median, double *mean, double *stddev, double *minimum) {
+    double sorted [SAMPLES];
+    memcpy(sorted, result->nsPerOp, sizeof(sorted));
+    qsort(sorted, SAMPLES, sizeof(double), compare_doubles);
+
+    *median = sorted[SAMPLES / 2];
+    *minimum = sorted[0];
+    *mean = 0;
+    for(int s = 0; s < SAMPLES; s++) *mean += sorted[s] / SAMPLES;
+    double variance = 0;
+    for(int s = 0; s < SAMPLES; s++) variance += (sorted[s] - *mean) * (sorted[s] - *mean) / (SAMPLES - 1);
+    *stddev = sqrt(variance);
+}
+
+int main(int argc, char **argv) {
+    const char *outputPath = argc > 1 ? argv[1] : "bench_results.json";
+    const char *label = argc > 2 ? argv[2] : "";
+
+    set_debug_logging(false);
+    set_tracing(false);
+
+    run_bench("legal_move", bench_legal_move);
+    run_bench("tile_attacked", bench_tile_attacked);
+    run_bench("has_valid_move", bench_has_valid_move);
+    run_bench("analyze_board", bench_analyze_board);
+    run_bench("find_move_sources", bench_find_move_sources);
+    if(tablebase_open("tablebases")) run_bench("tablebase_probe", bench_tablebase_probe);
+    run_bench("understand", bench_understand);
+    run_bench("min_disruption", bench_min_disruption);
+    run_bench("corridor_route", bench_corridor_route);
+    run_bench("motor_instruct", bench_motor_instruct);
+    run_bench("plan_cache_hit", bench_plan_cache_hit);
+    run_bench("park_carriage", bench_park_carriage);
+
+    FILE *out = fopen(outputPath, "w");
+    if(out == NULL) {
+        fprintf(stderr, "Can't write %s\n", outputPath);
+        return 1;
+    }
+
+    printf("%-16s %12s %12s %10s %12s\n", "benchmark", "median ns/op", "min ns/op", "stddev %", "allocs/op");
+    fprintf(out, "{\n  \"schema\": 1,\n  \"label\": \"%s\",\n  \"samples\": %d,\n  \"benchmarks\": [\n", label, SAMPLES);
+    for(int i = 0; i < numResults; i++) {
+        double median, mean, stddev, minimum;
+        summarise(&results[i], &median, &mean, &stddev, &minimum);
+        printf("%-16s %12.1f %12.1f %10.2f %12.3f\n", results[i].name, median, minimum, 100 * stddev / mean, results[i].allocsPerOp);
+        fprintf(out, "    {\"name\": \"%s\", \"ops_per_sample\": %lld, \"ns_per_op_median\": %.3f, \"ns_per_op_mean\": %.3f, "
+            "\"ns_per_op_stddev\": %.3f, \"ns_per_op_min\": %.3f, \"allocs_per_op\": %.4f}%s\n", results[i].name, results[i].opsPerSample,
+            median, mean, stddev, minimum, results[i].allocsPerOp, i == numResults - 1 ? "" : ",");
+    }
+    fprintf(out, "  ]\n}\n");
+    fclose(out);
+    return 0;
+}
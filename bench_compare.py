@@ -0,0 +1,47 @@
+import json
+import sys
+
+# Compares two bench.c result files, e.g. one from master and one from a branch:
+#     python3 bench_compare.py old.json new.json [threshold_percent]
+# A benchmark counts as a regression when its median got slower by more than the threshold AND by more than
+# two standard deviations of either run, so that ordinary noise doesn't fail the comparison.
+# Exits with status 1 if anything regressed.
+
+def load(path):
+	with open(path) as f:
+		data = json.load(f)
+	return data.get("label", ""), {b["name"]: b for b in data["benchmarks"]}
+
+if __name__ == '__main__':
+	if len(sys.argv) < 3:
+		print("Usage: python3 bench_compare.py old.json new.json [threshold_percent]")
+		sys.exit(2)
+
+	threshold = float(sys.argv[3]) if len(sys.argv) > 3 else 5.0
+	oldLabel, old = load(sys.argv[1])
+	newLabel, new = load(sys.argv[2])
+	print("Comparing {} -> {}".format(oldLabel or sys.argv[1], newLabel or sys.argv[2]))
+	print("{:<16} {:>12} {:>12} {:>9} {:>10}".format("benchmark", "old ns/op", "new ns/op", "change", "allocs/op"))
+
+	regressed = False
+	for name in list(old) + [n for n in new if n not in old]:
+		if name not in old or name not in new:
+			print("{:<16} {}".format(name, "only in " + ("old" if name in old else "new")))
+			continue
+
+		a, b = old[name], new[name]
+		change = 100.0 * (b["ns_per_op_median"] - a["ns_per_op_median"]) / a["ns_per_op_median"]
+		noise = 2 * max(a["ns_per_op_stddev"], b["ns_per_op_stddev"])
+		verdict = ""
+		if change > threshold and b["ns_per_op_median"] - a["ns_per_op_median"] > noise:
+			verdict = "REGRESSION"
+			regressed = True
+		elif change < -threshold and a["ns_per_op_median"] - b["ns_per_op_median"] > noise:
+			verdict = "improved"
+		if b["allocs_per_op"] > a["allocs_per_op"]:
+			verdict += " (more allocations)"
+			regressed = True
+
+		print("{:<16} {:>12.1f} {:>12.1f} {:>+8.1f}% {:>10.3f} {}".format(name, a["ns_per_op_median"], b["ns_per_op_median"], change, b["allocs_per_op"], verdict))
+
+	sys.exit(1 if regressed else 0)
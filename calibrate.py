@@ -0,0 +1,166 @@
+import json
+import os
+import sys
+import termios
+import time
+import tty
+from motion import PIECE_NAMES, PROFILE_FILE, load_profile
+
+# Measures a rig and writes what it finds into its profile (rig_profile.json), which motion.py reads.
+#     python3 calibrate.py magnet PORT   (with electromagnet_code.ino flashed)
+#     python3 calibrate.py axes PORT     (with motor_code.ino flashed)
+
+BAUD_RATE = termios.B57600
+REPLY_TIMEOUT_SECONDS = 60 # Five trials of up to 3 seconds each way, with room to spare
+
+# Step-rate search
+AXES = {"file": "F", "rank": "R"} # Profile name, and the letter motor_code.ino uses for the axis
+TRIAL_TILES = 3 # Out and back this far
+TRIALS = 3 # Runs at each setting, all of which have to come back without losing steps
+LOST_STEP_TOLERANCE = 4 # The endstop doesn't always trip on the same step
+START_RATE = 200 # Steps per second, slow enough for any rig
+RATE_FACTOR = 1.25
+MAX_RATE = 40000
+MAX_ACCEL_DOUBLINGS = 8
+SAFETY_MARGIN = 0.8 # Fraction of the fastest setting that passed which is saved
+
+class SerialLine:
+	# Line-based serial link to a calibration sketch
+	def __init__(self, path):
+		self.fd = os.open(path, os.O_RDWR | os.O_NOCTTY)
+		tty.setraw(self.fd)
+		attributes = termios.tcgetattr(self.fd)
+		attributes[4] = attributes[5] = BAUD_RATE
+		termios.tcsetattr(self.fd, termios.TCSANOW, attributes)
+		time.sleep(2) # Opening the port resets the Arduino
+		termios.tcflush(self.fd, termios.TCIFLUSH)
+		self.buffer = b""
+
+	def send(self, line):
+		os.write(self.fd, (line + "\n").encode())
+
+	def read_line(self, timeout=REPLY_TIMEOUT_SECONDS):
+		deadline = time.time() + timeout
+		while b"\n" not in self.buffer:
+			if(time.time() > deadline):
+				raise TimeoutError("no reply from the rig")
+			self.buffer += os.read(self.fd, 256)
+		line, self.buffer = self.buffer.split(b"\n", 1)
+		return line.decode().strip()
+
+	def close(self):
+		os.close(self.fd)
+
+def ask(prompt):
+	input(prompt + " and press enter ")
+
+def save_profile(profile, path=PROFILE_FILE):
+	with open(path, "w") as file:
+		json.dump(profile, file, indent="\t")
+	print("Saved to " + path)
+
+# Times how long each piece takes to settle once the magnet is switched on and off, with the ramps from the profile
+def calibrate_magnet(port):
+	profile = load_profile()
+	magnet = profile["magnet"]
+	link = SerialLine(port)
+	link.send("R {} {} {} {}".format(round(1000 * magnet["rampUpSeconds"]), round(1000 * magnet["rampDownSeconds"]),
+		round(255 * magnet["hold"]), round(255 * magnet["boost"])))
+	link.read_line()
+
+	settle = {}
+	for name in PIECE_NAMES:
+		if(input("Put a {} under the magnet and press enter (or type s to skip) ".format(name)).strip() == "s"):
+			continue
+		link.send("C")
+		reply = link.read_line().split()
+		if(len(reply) != 3 or reply[0] != "SETTLE"):
+			print("Unexpected reply: " + " ".join(reply))
+			continue
+		settle[name] = {"on": int(reply[1]) / 1000, "off": int(reply[2]) / 1000}
+		print("{}: {:.3f}s on, {:.3f}s off".format(name, settle[name]["on"], settle[name]["off"]))
+	link.close()
+
+	if(len(settle) == 0):
+		print("Nothing measured, profile unchanged")
+		return
+	settle["default"] = {direction: max(s[direction] for s in settle.values()) for direction in ("on", "off")} # Slowest, for pieces that were skipped
+	magnet["settleSeconds"] = settle
+	save_profile(profile)
+
+# Steps from where the carriage is now back to the endstop, per axis
+def find_endstops(link):
+	found = {}
+	for name, axis in AXES.items():
+		link.send("F " + axis)
+		reply = link.read_line().split()
+		if(len(reply) != 2 or reply[0] != "FOUND" or int(reply[1]) < 0):
+			raise RuntimeError("{} endstop not found: {}".format(name, " ".join(reply)))
+		found[name] = int(reply[1])
+	return found
+
+# Whether the axis comes back to where it started every time at this rate and acceleration
+def trial(link, axis, rate, accel, steps, loaded):
+	for _ in range(TRIALS):
+		link.send("T {} {:.0f} {:.0f} {} {}".format(axis, rate, accel, steps, 1 if loaded else 0))
+		reply = link.read_line().split()
+		if(len(reply) != 2 or reply[0] != "TRIAL" or int(reply[1]) > LOST_STEP_TOLERANCE):
+			return False
+	return True
+
+# Fastest rate, then fastest acceleration at that rate, that the axis runs at without losing steps
+def search_limits(link, axis, stepsPerTile, loaded):
+	steps = round(TRIAL_TILES * stepsPerTile)
+	gentle = lambda rate: 2 * rate * rate / steps # Reaches full speed a quarter of the way out
+
+	rate = START_RATE
+	if(not trial(link, axis, rate, gentle(rate), steps, loaded)):
+		raise RuntimeError("axis {} loses steps even at {} steps/s".format(axis, START_RATE))
+	while rate * RATE_FACTOR <= MAX_RATE and trial(link, axis, rate * RATE_FACTOR, gentle(rate * RATE_FACTOR), steps, loaded):
+		rate *= RATE_FACTOR
+	rate *= SAFETY_MARGIN
+
+	accel = gentle(rate)
+	for _ in range(MAX_ACCEL_DOUBLINGS):
+		if(not trial(link, axis, rate, accel * 2, steps, loaded)):
+			break
+		accel *= 2
+	return {"rate": round(rate), "accel": round(accel * SAFETY_MARGIN)}
+
+# Measures steps per tile, then the speed limits of each axis with and without a piece in tow
+def calibrate_axes(port):
+	profile = load_profile()
+	link = SerialLine(port)
+
+	corners = []
+	for square in ("a1", "h8"):
+		link.send("E 0")
+		link.read_line()
+		ask("Push the magnet under the centre of {}".format(square))
+		link.send("E 1")
+		link.read_line()
+		corners.append(find_endstops(link))
+	for name in AXES:
+		if(corners[1][name] <= corners[0][name]):
+			raise RuntimeError("{} endstop is at the wrong end of the axis".format(name))
+		profile["axes"][name]["stepsPerTile"] = round((corners[1][name] - corners[0][name]) / 7, 1)
+		print("{}: {} steps per tile".format(name, profile["axes"][name]["stepsPerTile"]))
+
+	for load in ("unloaded", "loaded"):
+		if(load == "loaded"):
+			ask("Put a king on the board over the magnet")
+		for name, axis in AXES.items():
+			limits = search_limits(link, axis, profile["axes"][name]["stepsPerTile"], load == "loaded")
+			profile["axes"][name][load] = limits
+			print("{} {}: {} steps/s, {} steps/s/s".format(name, load, limits["rate"], limits["accel"]))
+	link.close()
+	save_profile(profile)
+
+if __name__ == '__main__':
+	if(len(sys.argv) == 3 and sys.argv[1] == "magnet"):
+		calibrate_magnet(sys.argv[2])
+	elif(len(sys.argv) == 3 and sys.argv[1] == "axes"):
+		calibrate_axes(sys.argv[2])
+	else:
+		print("Usage: python3 calibrate.py magnet|axes PORT")
+		sys.exit(2)
@@ -3,6 +3,13 @@
 #include <stdbool.h>
 #include <string.h>
 #include <math.h>
+#include <time.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
 
 // A standard chessboard is 8 x 8.
 // Our board size has been extended to 10 x 10 to allow for captured pieces to be placed on the outer perimeter of the board.
@@ -72,6 +79,10 @@ bool kingMoved [2];
 bool aRookMoved [2];
 bool hRookMoved [2];
 
+// Piece that a pawn is promoted to upon reaching the last rank ('q', 'r', 'b' or 'n')
+// The player may name a different piece in their move command; resets to queen after every turn
+char promote_letter = 'q';
+
 /*
  * DECLARATIONS FOR PHYSICAL CHESSBOARD INTEGRATION
  * Variables, constants, and functions that are needed to properly link the physical chessboard components with the chess code
@@ -83,6 +94,12 @@ bool hRookMoved [2];
 float motorRow = 0;
 float motorCol = 0;
 
+// Electromagnet state as of the last magnet command handed to the controller
+int magnetState = 0;
+
+void motor_move_both(float deltaX, float deltaY, bool withOverflow);
+void publish_snapshot();
+
 // Stale move counter, which is reset every time a pawn is moved or a piece is captured.
 // Due to the 50 move rule, will force a draw once movesTillDraw reaches 0.
 // (50 moves per player = 100 "moves" total)
@@ -111,6 +128,7 @@ const int MAGNET_TOGGLE = 0;
 const int X_MOTOR_AXIS = 1;
 const int Y_MOTOR_AXIS = 2;
 const int BOTH_MOTOR_AXES = 3;
+const int PARK = 4; // Unloaded move in both axes (f1, f2) while waiting for the next move; the controller may abandon it part way
 
 // How much further the motor moves than the required distance when travelling across the board
 // This is needed because pieces are "dragged" by the electromagnet, resulting in pieces "positionally lagging" behind the electromagnet.
@@ -124,10 +142,19 @@ struct next_command {
 };
 
 // Commands are processed one by one after being inputted by the physical chessboard controller
-// The queue will not realistically exceed 24 commands, so a fixed allocation is fine
-struct next_command commandQueue [24];
+// A move plans every piece it relocates at once (captures and castling included), so leave room for several legs
+#define COMMAND_QUEUE_SIZE 256
+struct next_command commandQueue [COMMAND_QUEUE_SIZE];
 int numCommandsInQueue = 0;
 
+// Outcome of the most recent motion plan, so the controller can tell a physical failure apart from an illegal move
+const int PLAN_OK = 0;
+const int PLAN_NO_EXIT = 1; // A piece blocking the path had nowhere to be moved aside to
+const int PLAN_NO_ROUTE = 2; // A piece that was moved aside couldn't get back
+const int PLAN_QUEUE_FULL = 3; // The plan didn't fit in the command queue
+int planStatus = 0;
+int get_plan_status() { return planStatus; }
+
 bool has_commands() {
     return numCommandsInQueue > 0;
 }
@@ -138,8 +165,10 @@ int get_command_type() {
 
 // Pops the top command in the command queue
 void go_next_command() {
+    if(commandQueue[0].commandType == MAGNET_TOGGLE) magnetState = commandQueue[0].i1;
     for(int i = 0; i < numCommandsInQueue - 1; i++) { commandQueue[i] = commandQueue[i + 1]; }
     numCommandsInQueue--;
+    publish_snapshot();
 }
 
 // Command types that use an integer parameter only use one integer parameter
@@ -164,7 +193,10 @@ float get_float_command_value_b() {
 }
 
 void queue_command(int type, int i1, float f1, float f2) {
-    if(numCommandsInQueue >= 24) return;
+    if(numCommandsInQueue >= COMMAND_QUEUE_SIZE) {
+        planStatus = PLAN_QUEUE_FULL;
+        return;
+    }
 
     struct next_command q_command = {type, i1, f1, f2};
     commandQueue[numCommandsInQueue] = q_command;
@@ -176,23 +208,682 @@ void queue_command(int type, int i1, float f1, float f2) {
  * Variables, constants, and functions that are needed to properly execute TTS directives.
  */
 
-// Message to be spoken aloud using TTS
-char *narration;
+#define TTS_QUEUE_SIZE 8
+#define TTS_MESSAGE_LENGTH 128
+
+// Narration priorities; pending messages are spoken highest priority first, oldest first within a priority
+const int TTS_INFO = 0; // Turn announcements, which go stale as soon as something else happens
+const int TTS_NORMAL = 1; // Feedback on the move just made (illegal move, promotion, etc.)
+const int TTS_ALERT = 2; // Check
+const int TTS_GAME_OVER = 3; // Checkmate, stalemate and draws
+
+struct tts_message {
+    int priority; // TTS_INFO, TTS_NORMAL, etc.
+    long long sequence; // Order in which messages were queued
+    char text [TTS_MESSAGE_LENGTH];
+};
+
+// Messages waiting to be spoken aloud using TTS
+// Text is copied in, so callers may pass temporary buffers
+struct tts_message ttsQueue [TTS_QUEUE_SIZE];
+int numTtsMessages = 0;
+long long ttsSequence = 0;
+char ttsSpeaking [TTS_MESSAGE_LENGTH]; // Message most recently handed out by get_tts()
+
+// Removes the pending message at the given index
+void drop_tts(int index) {
+    for(int i = index; i < numTtsMessages - 1; i++) ttsQueue[i] = ttsQueue[i + 1];
+    numTtsMessages--;
+}
+
+void clear_tts() { numTtsMessages = 0; }
+
+// Queues a message, coalescing it with what is already pending:
+// repeats are dropped, a newer turn announcement replaces an older one, and the end of the game silences turn announcements
+// Returns false if the message itself was dropped
+bool queue_tts(char *text, int priority) {
+    bool gameOver = priority == TTS_GAME_OVER;
+    for(int i = numTtsMessages - 1; i >= 0; i--) {
+        if(ttsQueue[i].priority == TTS_GAME_OVER && priority == TTS_INFO) return false;
+        if(!strcmp(ttsQueue[i].text, text) || (ttsQueue[i].priority == TTS_INFO && (priority == TTS_INFO || gameOver))) drop_tts(i);
+    }
+
+    if(numTtsMessages == TTS_QUEUE_SIZE) { // Full, make room by dropping the oldest of the least important messages
+        int victim = 0;
+        for(int i = 1; i < numTtsMessages; i++) {
+            if(ttsQueue[i].priority < ttsQueue[victim].priority) victim = i;
+        }
+        if(ttsQueue[victim].priority > priority) return false; // Everything pending matters more
+        drop_tts(victim);
+    }
+
+    struct tts_message *message = &ttsQueue[numTtsMessages++];
+    message->priority = priority;
+    message->sequence = ttsSequence++;
+    strncpy(message->text, text, TTS_MESSAGE_LENGTH - 1);
+    message->text[TTS_MESSAGE_LENGTH - 1] = '\0';
+    return true;
+}
+
+void set_tts(char *text) { queue_tts(text, TTS_NORMAL); }
 
-void set_tts(char *text) { narration = text; }
+bool has_tts() { return numTtsMessages > 0; }
 
+// Pops the most important pending message, or returns "" if there is none
+// The returned text stays valid until the next call
 char *get_tts() {
-    if(narration == NULL) return "";
+    if(numTtsMessages == 0) return "";
 
-    char *returnValue = narration;
-    narration = NULL;
-    return returnValue;
+    int next = 0;
+    for(int i = 1; i < numTtsMessages; i++) {
+        if(ttsQueue[i].priority > ttsQueue[next].priority) next = i; // Queue is in sequence order, so ties go to the oldest
+    }
+    strcpy(ttsSpeaking, ttsQueue[next].text);
+    drop_tts(next);
+    return ttsSpeaking;
 }
 
 // Print a copy of TTS to the console as well for written record
-void print_tts_message(char *message) {
-    narration = message;
-    printf("[MESSAGE] %s\n", message);
+void announce(char *message, int priority) {
+    if(queue_tts(message, priority)) printf("[MESSAGE] %s\n", message);
+}
+
+void print_tts_message(char *message) { announce(message, TTS_NORMAL); }
+
+/*
+ * DECLARATIONS FOR LATENCY TRACING!
+ * Variables, constants, and functions that are needed to time each stage of a turn.
+ * Spans are kept in a ring buffer and can be dumped as JSON lines or as a Chrome trace (chrome://tracing).
+ */
+
+// Identifiers for the traced stages of a turn
+// Speech capture, motor segments, magnet settling and TTS happen in the controller, which records them through trace_record()
+const int TRACE_SPEECH = 0;
+const int TRACE_UNDERSTAND = 1;
+const int TRACE_VALIDATE = 2;
+const int TRACE_PLAN = 3; // move_piece()/move_castle(), including motor path planning
+const int TRACE_MOTOR = 4;
+const int TRACE_MAGNET = 5;
+const int TRACE_TTS = 6;
+#define TRACE_STAGES 7
+
+const char *TRACE_NAMES [TRACE_STAGES] = {"speech", "understand", "validate_move", "move_piece", "motor_segment", "magnet_settle", "tts"};
+
+struct trace_span {
+    int stage; // TRACE_SPEECH, TRACE_UNDERSTAND, etc.
+    int turnNumber; // Which call to run_chess_algorithm() the span belongs to
+    long long startNs; // Monotonic timestamps, see trace_now()
+    long long endNs;
+};
+
+// Only the most recent spans are kept; older ones are overwritten
+#define TRACE_BUFFER_SIZE 4096
+struct trace_span traceBuffer [TRACE_BUFFER_SIZE];
+long long traceCount = 0; // Total number of spans ever recorded
+int traceTurn = 0;
+bool tracingEnabled = true;
+
+// Latency histograms, one per stage. Bucket b counts spans lasting [2^b, 2^(b+1)) microseconds (bucket 0 also holds anything under 1us)
+// Unlike the ring buffer, histograms are never overwritten
+#define TRACE_HISTOGRAM_BUCKETS 32
+long long traceHistogram [TRACE_STAGES][TRACE_HISTOGRAM_BUCKETS];
+long long traceStageCount [TRACE_STAGES];
+long long traceStageTotalNs [TRACE_STAGES];
+long long traceStageMaxNs [TRACE_STAGES];
+
+void set_tracing(bool enabled) { tracingEnabled = enabled; }
+
+// Monotonic clock in nanoseconds; the controller should use this too so that all spans share one timeline
+long long trace_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+void trace_record(int stage, long long startNs, long long endNs) {
+    if(!tracingEnabled || stage < 0 || stage >= TRACE_STAGES) return;
+
+    struct trace_span span = {stage, traceTurn, startNs, endNs};
+    traceBuffer[traceCount % TRACE_BUFFER_SIZE] = span;
+    traceCount++;
+
+    long long duration = endNs - startNs;
+    long long micros = duration / 1000;
+    int bucket = 0;
+    while(micros > 1 && bucket < TRACE_HISTOGRAM_BUCKETS - 1) {
+        micros >>= 1;
+        bucket++;
+    }
+    traceHistogram[stage][bucket]++;
+    traceStageCount[stage]++;
+    traceStageTotalNs[stage] += duration;
+    if(duration > traceStageMaxNs[stage]) traceStageMaxNs[stage] = duration;
+}
+
+void trace_reset() {
+    traceCount = 0;
+    for(int i = 0; i < TRACE_STAGES; i++) {
+        for(int j = 0; j < TRACE_HISTOGRAM_BUCKETS; j++) traceHistogram[i][j] = 0;
+        traceStageCount[i] = traceStageTotalNs[i] = traceStageMaxNs[i] = 0;
+    }
+}
+
+// Upper bound (in microseconds) of the histogram bucket containing the given percentile
+long long trace_percentile_us(int stage, int percentile) {
+    long long target = (traceStageCount[stage] * percentile + 99) / 100;
+    long long seen = 0;
+    for(int bucket = 0; bucket < TRACE_HISTOGRAM_BUCKETS; bucket++) {
+        seen += traceHistogram[stage][bucket];
+        if(seen >= target) return 2LL << bucket;
+    }
+    return 2LL << (TRACE_HISTOGRAM_BUCKETS - 1);
+}
+
+void trace_print_histograms() {
+    for(int stage = 0; stage < TRACE_STAGES; stage++) {
+        if(traceStageCount[stage] == 0) continue;
+        printf("[TRACE] %-14s n=%lld mean=%.1fus p50<%lldus p90<%lldus p99<%lldus max=%.1fus\n", TRACE_NAMES[stage], traceStageCount[stage],
+            traceStageTotalNs[stage] / 1000.0 / traceStageCount[stage], trace_percentile_us(stage, 50), trace_percentile_us(stage, 90),
+            trace_percentile_us(stage, 99), traceStageMaxNs[stage] / 1000.0);
+    }
+}
+
+// Index of the oldest span still held in the ring buffer
+long long trace_first_index() { return traceCount > TRACE_BUFFER_SIZE ? traceCount - TRACE_BUFFER_SIZE : 0; }
+
+// One JSON object per line, timestamps in nanoseconds
+bool trace_dump_json_lines(char *path) {
+    FILE *out = fopen(path, "w");
+    if(out == NULL) return false;
+
+    for(long long i = trace_first_index(); i < traceCount; i++) {
+        struct trace_span *span = &traceBuffer[i % TRACE_BUFFER_SIZE];
+        fprintf(out, "{\"stage\":\"%s\",\"turn\":%d,\"start_ns\":%lld,\"end_ns\":%lld,\"duration_ns\":%lld}\n",
+            TRACE_NAMES[span->stage], span->turnNumber, span->startNs, span->endNs, span->endNs - span->startNs);
+    }
+    fclose(out);
+    return true;
+}
+
+// Chrome trace event format; each stage gets its own row ("tid") in the viewer
+bool trace_dump_chrome(char *path) {
+    FILE *out = fopen(path, "w");
+    if(out == NULL) return false;
+
+    fprintf(out, "{\"traceEvents\":[\n");
+    for(long long i = trace_first_index(); i < traceCount; i++) {
+        struct trace_span *span = &traceBuffer[i % TRACE_BUFFER_SIZE];
+        fprintf(out, "%s{\"name\":\"%s\",\"cat\":\"chessboard\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d,\"args\":{\"turn\":%d}}\n",
+            i == trace_first_index() ? "" : ",", TRACE_NAMES[span->stage], span->startNs / 1000.0, (span->endNs - span->startNs) / 1000.0,
+            span->stage, span->turnNumber);
+    }
+    fprintf(out, "]}\n");
+    fclose(out);
+    return true;
+}
+
+// [DEBUG] motor/magnet lines can be silenced when they aren't needed (they dominate planning time when printed to a terminal)
+bool debugLogging = true;
+void set_debug_logging(bool enabled) { debugLogging = enabled; }
+
+/*
+ * DECLARATIONS FOR SHARED-MEMORY SNAPSHOTS!
+ * Variables, constants, and functions that are needed to let other processes (spectator display, dashboard) watch the game live.
+ * The snapshot lives in a POSIX shared-memory segment and is guarded by a seqlock: the control loop never waits on readers,
+ * and readers retry whenever the sequence number was odd or changed while they were copying. See snapshot_reader.py.
+ * On older glibc versions, link with -lrt for shm_open().
+ */
+
+#define SNAPSHOT_MAGIC 0x43485353 // "SSHC" in memory, identifies the segment
+#define SNAPSHOT_VERSION 1 // Bump whenever the layout below changes
+
+// Fixed layout, every field is 4 bytes wide (or made of 4-byte fields) so the reader can mirror it without padding surprises
+struct board_snapshot {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size; // sizeof(struct board_snapshot), as a layout check
+    uint32_t sequence; // Odd while the snapshot is being written
+    int32_t turn; // WHITE or BLACK, the player to move
+    int32_t status; // Result of analyze_board() for the last move: 0 check, 1 checkmate, 2 stalemate, -1 none of the above
+    int32_t running;
+    int32_t magnetOn; // Magnet state as of the last command the controller picked up
+    float carriageRow; // Where the carriage is headed with the command it is executing
+    float carriageCol;
+    float plannedRow; // Where the carriage ends up once the pending plan is done (motorRow/motorCol)
+    float plannedCol;
+    int32_t numCommands; // Pending plan, next command first
+    struct next_command commands [COMMAND_QUEUE_SIZE];
+    char board [BOARD_SIZE][BOARD_SIZE]; // Rank-first like board: 'P', 'N', ... for white, 'p', 'n', ... for black, '.' for empty
+};
+
+struct board_snapshot *snapshot = NULL;
+int boardStatus = -1; // See board_snapshot.status
+
+// Creates (or reopens) the shared-memory segment with the given name, e.g. "/chessboard", and publishes the current state
+bool open_snapshot_channel(char *name) {
+    int fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+    if(fd == -1) return false;
+
+    if(ftruncate(fd, sizeof(struct board_snapshot)) == -1) {
+        close(fd);
+        return false;
+    }
+    void *segment = mmap(NULL, sizeof(struct board_snapshot), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd); // The mapping stays valid
+    if(segment == MAP_FAILED) return false;
+
+    snapshot = segment;
+    snapshot->magic = SNAPSHOT_MAGIC;
+    snapshot->version = SNAPSHOT_VERSION;
+    snapshot->size = sizeof(struct board_snapshot);
+    snapshot->sequence &= ~1u; // A writer that died half way left it odd, and publish_snapshot() relies on it starting even
+    publish_snapshot();
+    return true;
+}
+
+// Stops publishing and removes the segment; readers that still have it mapped keep the last snapshot
+void close_snapshot_channel(char *name) {
+    if(snapshot == NULL) return;
+    munmap(snapshot, sizeof(struct board_snapshot));
+    snapshot = NULL;
+    shm_unlink(name);
+}
+
+/*
+ * DECLARATIONS FOR STREAMING SPEECH INPUT!
+ * Variables, constants, and functions that are needed to understand a move while it is still being spoken.
+ * The recognizer feeds partial hypotheses to understand_partial(), which commits as soon as only one legal move fits what has been heard.
+ */
+
+// Every legal move for the player to move, in the notation produced by understand() ("pe2e4", "o-o", etc.)
+// Generated once per utterance by begin_utterance()
+#define MAX_CANDIDATES 256
+char candidateMoves [MAX_CANDIDATES][6];
+int numCandidates = 0;
+int numCandidatesLeft = 0; // How many are still consistent with the latest partial hypothesis
+int get_candidates_left() { return numCandidatesLeft; }
+
+/*
+ * DECLARATIONS FOR ENDGAME TABLEBASES!
+ * Variables, constants, and functions that are needed to look up endgames with few pieces left in precomputed tables.
+ * The tables are generated offline by tablebase_gen.c, one file per material signature ("KQK.tb", "KRKP.tb", ...),
+ * and memory-mapped the first time a position with that material comes up.
+ * Castling and en passant aren't part of the tables, so positions where either is still possible aren't looked up.
+ */
+
+#define TB_MAX_PIECES 4 // Kings included
+#define TB_MAX_TABLES 64 // Signatures that can be mapped at once
+#define TB_MAGIC "CHESSTB1"
+
+// Every entry is one byte, from the point of view of the player to move:
+// 0 is a draw, n > 0 wins with mate in n plies, n < 0 loses to mate in -n - 1 plies (so -1 means already checkmated)
+const int TB_DRAW = 0;
+const int TB_ILLEGAL = -128; // Positions that can't come up (kings touching, player not to move in check, ...)
+const int TB_UNKNOWN = 127; // Never stored; returned when no table covers the position
+
+// Table file layout: this header, then one entry per index (see tablebase_index())
+struct tablebase_header {
+    char magic [8]; // TB_MAGIC
+    char signature [16]; // e.g. "KQKR", white's pieces first
+    uint32_t numPieces;
+    uint32_t reserved;
+    uint64_t numEntries;
+};
+
+// One piece of an endgame position; squares are rank * 8 + file, ranks and files within [0, 8)
+struct tb_piece {
+    int pieceId;
+    int colour;
+    int square;
+};
+
+struct tablebase {
+    char signature [16];
+    int8_t *entries; // NULL if there's no usable file for this signature
+    void *mapping;
+    size_t mappedSize;
+};
+
+char tablebaseDirectory [256] = ""; // Empty until tablebase_open() is called
+struct tablebase tablebases [TB_MAX_TABLES];
+int numTablebases = 0;
+bool tablebaseAdjudication = true; // Whether a position the tables call a draw ends the game
+bool tablebaseAnnounced = false; // Whether a forced mate has been announced this game
+void set_tablebase_adjudication(bool enabled) { tablebaseAdjudication = enabled; }
+
+int tablebase_plies(int value) { return value > 0 ? value : -value - 1; }
+bool tablebase_is_result(int value) { return value != TB_UNKNOWN && value != TB_ILLEGAL; }
+
+// Order of pieces within each side of a signature: king, queens, rooks, bishops, knights, pawns
+int tb_order(int pieceId) { return pieceId == KING_ID ? 0 : QUEEN_ID + 1 - pieceId; }
+
+void tb_sort(struct tb_piece *pieces, int numPieces) {
+    for(int i = 1; i < numPieces; i++) {
+        struct tb_piece p = pieces[i];
+        int j = i;
+        for(; j > 0; j--) {
+            struct tb_piece *q = &pieces[j - 1];
+            if(q->colour < p.colour || (q->colour == p.colour && (tb_order(q->pieceId) < tb_order(p.pieceId) || (q->pieceId == p.pieceId && q->square < p.square)))) break;
+            pieces[j] = *q;
+        }
+        pieces[j] = p;
+    }
+}
+
+// Puts an endgame position in the form the tables are indexed by, and returns the player to move afterwards:
+// white is the stronger side (otherwise colours are swapped, ranks flipped and the other player is to move),
+// the white king is on files a-d (otherwise files are mirrored), and pieces are in signature order, ties broken by square
+int tablebase_canonical(struct tb_piece *pieces, int numPieces, int toMove) {
+    tb_sort(pieces, numPieces);
+
+    int firstBlack = 0;
+    while(firstBlack < numPieces && pieces[firstBlack].colour == WHITE) firstBlack++;
+    int numWhite = firstBlack, numBlack = numPieces - firstBlack;
+    int stronger = numWhite - numBlack; // More pieces wins, then the better piece at the first difference
+    for(int i = 1; stronger == 0 && i < numWhite; i++) stronger = tb_order(pieces[firstBlack + i].pieceId) - tb_order(pieces[i].pieceId);
+
+    if(stronger < 0) {
+        for(int i = 0; i < numPieces; i++) {
+            pieces[i].colour = 1 - pieces[i].colour;
+            pieces[i].square = (7 - pieces[i].square / 8) * 8 + pieces[i].square % 8;
+        }
+        toMove = 1 - toMove;
+        tb_sort(pieces, numPieces);
+    }
+    if(pieces[0].square % 8 > 3) {
+        for(int i = 0; i < numPieces; i++) pieces[i].square = (pieces[i].square / 8) * 8 + 7 - pieces[i].square % 8;
+        tb_sort(pieces, numPieces);
+    }
+    return toMove;
+}
+
+// Signature of a canonical position, e.g. "KQKR"
+void tablebase_signature(struct tb_piece *pieces, int numPieces, char *signature) {
+    const char letters [6] = {'P', 'N', 'B', 'R', 'Q', 'K'};
+    for(int i = 0; i < numPieces; i++) signature[i] = letters[pieces[i].pieceId];
+    signature[numPieces] = '\0';
+}
+
+// Index of a canonical position: player to move, white king (files a-d only), then every other piece's square
+uint64_t tablebase_index(struct tb_piece *pieces, int numPieces, int toMove) {
+    uint64_t index = toMove * 32 + (pieces[0].square / 8) * 4 + pieces[0].square % 8;
+    for(int i = 1; i < numPieces; i++) index = index * 64 + pieces[i].square;
+    return index;
+}
+
+uint64_t tablebase_entries(int numPieces) { return 64ULL << (6 * (numPieces - 1)); }
+
+void tablebase_close() {
+    for(int i = 0; i < numTablebases; i++) {
+        if(tablebases[i].mapping != NULL) munmap(tablebases[i].mapping, tablebases[i].mappedSize);
+    }
+    numTablebases = 0;
+}
+
+// Starts looking up endgames in the given directory; returns false if it can't be read
+bool tablebase_open(char *directory) {
+    tablebase_close();
+    tablebaseAnnounced = false;
+    if(access(directory, R_OK) != 0) {
+        tablebaseDirectory[0] = '\0';
+        return false;
+    }
+    snprintf(tablebaseDirectory, sizeof(tablebaseDirectory), "%s", directory);
+    return true;
+}
+
+// Maps the table for a signature the first time it's asked for; a missing or broken file is remembered as such
+struct tablebase *tablebase_find(char *signature) {
+    for(int i = 0; i < numTablebases; i++) {
+        if(!strcmp(tablebases[i].signature, signature)) return &tablebases[i];
+    }
+    if(numTablebases == TB_MAX_TABLES) return NULL;
+
+    struct tablebase *table = &tablebases[numTablebases++];
+    snprintf(table->signature, sizeof(table->signature), "%s", signature);
+    table->entries = NULL;
+    table->mapping = NULL;
+
+    char path [300];
+    snprintf(path, sizeof(path), "%s/%s.tb", tablebaseDirectory, signature);
+    int fd = open(path, O_RDONLY);
+    if(fd == -1) return table;
+    off_t size = lseek(fd, 0, SEEK_END);
+    uint64_t numEntries = tablebase_entries(strlen(signature));
+    if(size == -1 || (uint64_t) size != sizeof(struct tablebase_header) + numEntries) { // Unreadable, or not the size this table has to be
+        close(fd);
+        return table;
+    }
+    void *mapping = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // The mapping stays valid
+    if(mapping == MAP_FAILED) return table;
+
+    struct tablebase_header *header = mapping;
+    if(memcmp(header->magic, TB_MAGIC, 8) || strcmp(header->signature, signature) || header->numEntries != numEntries) {
+        munmap(mapping, size);
+        return table;
+    }
+    table->mapping = mapping;
+    table->mappedSize = size;
+    table->entries = (int8_t *) mapping + sizeof(struct tablebase_header);
+    return table;
+}
+
+// Looks up a position given as a list of pieces (in any order, at most TB_MAX_PIECES); "pieces" is left untouched
+int tablebase_probe_pieces(struct tb_piece *pieces, int numPieces, int toMove) {
+    if(tablebaseDirectory[0] == '\0' || numPieces < 2 || numPieces > TB_MAX_PIECES) return TB_UNKNOWN;
+
+    struct tb_piece canonical [TB_MAX_PIECES];
+    memcpy(canonical, pieces, numPieces * sizeof(struct tb_piece));
+    toMove = tablebase_canonical(canonical, numPieces, toMove);
+
+    char signature [TB_MAX_PIECES + 1];
+    tablebase_signature(canonical, numPieces, signature);
+    struct tablebase *table = tablebase_find(signature);
+    if(table == NULL || table->entries == NULL) return TB_UNKNOWN;
+    return table->entries[tablebase_index(canonical, numPieces, toMove)];
+}
+
+/*
+ * DECLARATIONS FOR MOTION PLAN CACHING!
+ * Variables, constants, and functions that are needed to remember motion plans instead of searching for them again.
+ * A plan only depends on which tiles of the board clone are occupied, where the carriage is, and where the piece goes,
+ * so the same layout (captures filling the perimeter in a fixed order, castling from the standard squares, a repeated opening)
+ * always produces the same program. See motor_instruct().
+ */
+
+#define PLAN_CACHE_SIZE 256 // Plans remembered at once, least recently used ones are forgotten first
+#define PLAN_CACHE_COMMANDS 64 // Longer plans aren't remembered
+#define PLAN_CACHE_PARKED 16
+
+struct plan_key {
+    uint64_t occupancy [2]; // One bit per tile of the board clone (row * BOARD_SIZE + col)
+    int32_t srcTile;
+    int32_t destTile;
+    float motorRow;
+    float motorCol;
+};
+
+struct cached_plan {
+    bool used;
+    uint64_t hash;
+    struct plan_key key;
+    long long lastUsed;
+
+    bool feasible;
+    int status; // planStatus of a plan that couldn't be found
+    int numCommands;
+    struct next_command commands [PLAN_CACHE_COMMANDS];
+    float motorRow; // Where the plan leaves the carriage
+    float motorCol;
+    float risk; // Added to planRisk
+    int numParked; // Captured pieces moved aside that stay where they were parked, as (fromTile, toTile)
+    int parked [PLAN_CACHE_PARKED][2];
+};
+
+struct cached_plan planCache [PLAN_CACHE_SIZE];
+long long planCacheClock = 0;
+bool planCacheEnabled = true;
+bool planCacheValidation = false; // Re-plan on every hit and compare, to catch anything the key misses
+long long planCacheHits = 0;
+long long planCacheMisses = 0;
+long long planCacheMismatches = 0;
+
+// Captured pieces clear_path() left where they were parked, for the plan being made (see cached_plan.parked)
+int planParked [BOARD_SIZE * BOARD_SIZE][2];
+int numPlanParked = 0;
+
+void set_plan_cache(bool enabled) { planCacheEnabled = enabled; }
+void set_plan_cache_validation(bool enabled) { planCacheValidation = enabled; }
+long long get_plan_cache_hits() { return planCacheHits; }
+long long get_plan_cache_misses() { return planCacheMisses; }
+long long get_plan_cache_mismatches() { return planCacheMismatches; }
+
+void clear_plan_cache() {
+    for(int i = 0; i < PLAN_CACHE_SIZE; i++) planCache[i].used = false;
+}
+
+/*
+ * DECLARATIONS FOR THE GAME ARCHIVE!
+ * Variables, constants, and functions that are needed to keep every game played, and to find the games that reached a position.
+ * An archive is a directory of three files, written to after every accepted move (see archive_record_move()):
+ *   games.bin      one record per game: an archive_game_header, the starting FEN if there was one, then one archive move per ply
+ *   games.off      offset of each game's record in games.bin, by game number (ARCHIVE_NO_RECORD until the record is written)
+ *   positions.log  one archive_position per position reached, in the order they were played
+ * Positions are identified by Zobrist keys (see position_key()). archive_query.c sorts the log into an index and searches it.
+ * Several boards can share one archive: appends are made under flock().
+ */
+
+#define ARCHIVE_MAGIC "GAME"
+#define ARCHIVE_MAX_PLIES 1024 // Moves past this aren't recorded (positions still are)
+#define ARCHIVE_NO_RECORD UINT64_MAX
+
+const int ARCHIVE_UNFINISHED = 0; // Game results
+const int ARCHIVE_WHITE_WINS = 1;
+const int ARCHIVE_BLACK_WINS = 2;
+const int ARCHIVE_DRAW = 3;
+
+// Moves are 16 bits: source square in bits 0-5 and destination in bits 6-11 (rank * 8 + file),
+// and the piece id promoted to in bits 12-14 (0 if none). Castling is recorded as the king's move.
+#define ARCHIVE_MOVE(src, dest, promotion) ((uint16_t) ((src) | ((dest) << 6) | ((promotion) << 12)))
+#define ARCHIVE_MOVE_SRC(move) ((move) & 63)
+#define ARCHIVE_MOVE_DEST(move) (((move) >> 6) & 63)
+#define ARCHIVE_MOVE_PROMOTION(move) (((move) >> 12) & 7)
+
+struct archive_game_header {
+    char magic [4];
+    uint32_t game; // Its number in games.off
+    int64_t startTime; // Unix time of the first move
+    uint16_t numPlies;
+    uint8_t result; // ARCHIVE_UNFINISHED, ARCHIVE_WHITE_WINS, ...
+    uint8_t fenLength; // 0 for the standard starting position, otherwise the FEN follows the header
+    uint32_t reserved;
+};
+
+struct archive_position {
+    uint64_t key;
+    uint32_t game;
+    uint16_t ply; // 0 is the starting position
+    uint16_t reserved;
+};
+
+int archiveGames = -1; // File descriptors, -1 while no archive is open
+int archiveOffsets = -1;
+int archivePositions = -1;
+
+// Game being recorded; it gets its number when its first move is recorded, so games without any moves aren't kept
+bool archivePending = false; // A game has been set up
+int64_t archiveGame = -1;
+int64_t archiveStartTime;
+char archiveFen [256];
+uint64_t archiveStartKey;
+uint16_t archiveMoves [ARCHIVE_MAX_PLIES];
+int archiveNumPlies = 0;
+
+uint64_t zobristPieces [2][6][64]; // [colour][pieceId][rank * 8 + file]
+uint64_t zobristBlackToMove;
+uint64_t zobristCastling [2][2]; // [colour][king side]
+uint64_t zobristEnPassant [8];
+bool zobristReady = false;
+
+// Fixed seed, so keys stay the same from one build to the next and old archives remain searchable
+void init_zobrist() {
+    uint64_t state = 0x43484553534B4559ULL;
+    uint64_t *keys [2 * 6 * 64 + 1 + 4 + 8];
+    int numKeys = 0;
+    for(int i = 0; i < 2 * 6 * 64; i++) keys[numKeys++] = &zobristPieces[0][0][0] + i;
+    keys[numKeys++] = &zobristBlackToMove;
+    for(int i = 0; i < 4; i++) keys[numKeys++] = &zobristCastling[0][0] + i;
+    for(int i = 0; i < 8; i++) keys[numKeys++] = &zobristEnPassant[i];
+
+    for(int i = 0; i < numKeys; i++) { // splitmix64
+        uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        *keys[i] = z ^ (z >> 31);
+    }
+    zobristReady = true;
+}
+
+// Appends to a file shared with other boards; returns the offset the data was written at, or -1
+int64_t archive_append(int fd, void *data, size_t size) {
+    flock(fd, LOCK_EX);
+    int64_t offset = lseek(fd, 0, SEEK_END);
+    if(offset != -1 && write(fd, data, size) != (ssize_t) size) offset = -1;
+    flock(fd, LOCK_UN);
+    return offset;
+}
+
+// Writes out the record of the game being recorded, if it got as far as a move
+void archive_finish_game(int result) {
+    if(archiveGames != -1 && archiveGame != -1) {
+        int fenLength = strlen(archiveFen);
+        int numPlies = (archiveNumPlies < ARCHIVE_MAX_PLIES ? archiveNumPlies : ARCHIVE_MAX_PLIES);
+        struct archive_game_header header = {ARCHIVE_MAGIC, archiveGame, archiveStartTime, numPlies, result, fenLength, 0};
+        char record [sizeof(header) + sizeof(archiveFen) + sizeof(archiveMoves)];
+        memcpy(record, &header, sizeof(header));
+        memcpy(record + sizeof(header), archiveFen, fenLength);
+        memcpy(record + sizeof(header) + fenLength, archiveMoves, numPlies * sizeof(uint16_t));
+
+        uint64_t offset = archive_append(archiveGames, record, sizeof(header) + fenLength + numPlies * sizeof(uint16_t));
+        if(offset != (uint64_t) -1) pwrite(archiveOffsets, &offset, sizeof(offset), archiveGame * sizeof(offset));
+        else printf("[ARCHIVE] Couldn't write game %lld\n", (long long) archiveGame);
+    }
+    archivePending = false;
+    archiveGame = -1;
+}
+
+// Opens (creating it if needed) the archive in the given directory, e.g. "archive"; games from now on are recorded in it
+bool archive_open(char *directory) {
+    mkdir(directory, 0755);
+    char path [512];
+    snprintf(path, sizeof(path), "%s/games.bin", directory);
+    int games = open(path, O_RDWR | O_CREAT, 0644);
+    snprintf(path, sizeof(path), "%s/games.off", directory);
+    int offsets = open(path, O_RDWR | O_CREAT, 0644);
+    snprintf(path, sizeof(path), "%s/positions.log", directory);
+    int positions = open(path, O_RDWR | O_CREAT, 0644);
+    if(games == -1 || offsets == -1 || positions == -1) {
+        if(games != -1) close(games);
+        if(offsets != -1) close(offsets);
+        if(positions != -1) close(positions);
+        return false;
+    }
+
+    archiveGames = games;
+    archiveOffsets = offsets;
+    archivePositions = positions;
+    return true;
+}
+
+// Stops recording; a game still in progress is kept as unfinished
+void archive_close() {
+    if(archiveGames == -1) return;
+    archive_finish_game(ARCHIVE_UNFINISHED);
+    close(archiveGames);
+    close(archiveOffsets);
+    close(archivePositions);
+    archiveGames = archiveOffsets = archivePositions = -1;
 }
 
 /*
@@ -243,6 +934,12 @@ bool prefix(char *pre, char *str) {
 int get_turn() { return turn; }
 int get_white() { return WHITE; }
 
+// FEN letter of the piece on a tile of the playable board (uppercase for white), or '.' if it is empty; rank and file in [0, 8)
+char get_square(int rank, int file) {
+    struct piece *p = board[BOARD_START + rank][BOARD_START + file];
+    return piece_equal(p, &NULL_PIECE) ? '.' : (p->colour == WHITE ? p->letter : p->letter + 32);
+}
+
 // Determines where the kings are on the board, and updates the local variables
 void find_kings() {
     for(int rank = 0; rank < 8; rank++) {
@@ -260,6 +957,88 @@ void find_kings() {
     }
 }
 
+// Zobrist key of the current position: placement, player to move, castling rights,
+// and the en passant file when the player to move has a pawn that could take there (so transpositions get the same key)
+uint64_t position_key() {
+    if(!zobristReady) init_zobrist();
+    uint64_t key = (turn == BLACK ? zobristBlackToMove : 0);
+    for(int rank = 0; rank < 8; rank++) {
+        for(int file = 0; file < 8; file++) {
+            struct piece *p = board[BOARD_START + rank][BOARD_START + file];
+            if(p->pieceId != -1) key ^= zobristPieces[p->colour][p->pieceId][rank * 8 + file];
+        }
+    }
+
+    for(int colour = WHITE; colour <= BLACK; colour++) {
+        int homeRank = BOARD_START + (colour == WHITE ? 0 : 7);
+        const struct piece *rook = (colour == WHITE ? &WHITE_ROOK : &BLACK_ROOK);
+        if(kingMoved[colour]) continue;
+        if(!hRookMoved[colour] && piece_equal(board[homeRank][BOARD_START + 7], rook)) key ^= zobristCastling[colour][1];
+        if(!aRookMoved[colour] && piece_equal(board[homeRank][BOARD_START], rook)) key ^= zobristCastling[colour][0];
+    }
+
+    int file = enPassantFile[other_colour(turn)];
+    if(file != -1) {
+        int rank = BOARD_START + (turn == WHITE ? 4 : 3); // Where the pawn that just advanced two tiles stands
+        const struct piece *pawn = (turn == WHITE ? &WHITE_PAWN : &BLACK_PAWN);
+        if((file > 0 && piece_equal(board[rank][BOARD_START + file - 1], pawn)) || (file < 7 && piece_equal(board[rank][BOARD_START + file + 1], pawn)))
+            key ^= zobristEnPassant[file];
+    }
+    return key;
+}
+
+// Called once a new game has been set up ("fen" is empty for the standard starting position)
+// A game that was still being recorded is kept as unfinished
+void archive_new_game(char *fen) {
+    if(archiveGames == -1) return;
+    archive_finish_game(ARCHIVE_UNFINISHED);
+    snprintf(archiveFen, sizeof(archiveFen), "%s", fen);
+    archiveStartKey = position_key();
+    archiveNumPlies = 0;
+    archivePending = true;
+}
+
+// Records a move that has just been played, by the player who was to move before "turn" changed hands
+void archive_record_move(char *parsedInput) {
+    if(archiveGames == -1 || !archivePending) return;
+
+    if(archiveGame == -1) { // First move, the game gets its number
+        uint64_t noRecord = ARCHIVE_NO_RECORD;
+        int64_t offset = archive_append(archiveOffsets, &noRecord, sizeof(noRecord));
+        if(offset == -1) {
+            printf("[ARCHIVE] Couldn't start a game record, this game won't be kept\n");
+            archivePending = false;
+            return;
+        }
+        archiveGame = offset / sizeof(noRecord);
+        archiveStartTime = time(NULL);
+        struct archive_position start = {archiveStartKey, archiveGame, 0, 0};
+        archive_append(archivePositions, &start, sizeof(start));
+    }
+
+    int mover = other_colour(turn);
+    int srcRank, srcFile, destRank, destFile, promotion = 0;
+    if(parsedInput[0] == 'o') { // Castling, recorded as the king's move
+        srcRank = destRank = (mover == WHITE ? 0 : 7);
+        srcFile = 4;
+        destFile = (strcmp(parsedInput, "o-o") ? 2 : 6);
+    } else {
+        srcFile = parsedInput[1] - 'a';
+        srcRank = parsedInput[2] - '1';
+        destFile = parsedInput[3] - 'a';
+        destRank = parsedInput[4] - '1';
+        struct piece *moved = board[BOARD_START + destRank][BOARD_START + destFile];
+        if(parsedInput[0] == 'p' && moved->pieceId != PAWN_ID) promotion = moved->pieceId;
+    }
+    if(archiveNumPlies < ARCHIVE_MAX_PLIES) archiveMoves[archiveNumPlies] = ARCHIVE_MOVE(srcRank * 8 + srcFile, destRank * 8 + destFile, promotion);
+    archiveNumPlies++;
+
+    struct archive_position position = {position_key(), archiveGame, archiveNumPlies, 0};
+    archive_append(archivePositions, &position, sizeof(position));
+
+    if(!isRunning) archive_finish_game(boardStatus == 1 ? (mover == WHITE ? ARCHIVE_WHITE_WINS : ARCHIVE_BLACK_WINS) : ARCHIVE_DRAW);
+}
+
 // Initializes board state at the beginning of the game
 // Not the same as resetting the board! This function assumes that pieces are already placed in correct positions
 // The physical chessboard is responsible for placing every piece in place before invoking this function
@@ -280,7 +1059,7 @@ void init_board() {
     board[BOARD_START + 7][BOARD_START + 1] = board[BOARD_START + 7][BOARD_START + 6] = &BLACK_KNIGHT;
     board[BOARD_START + 7][BOARD_START + 2] = board[BOARD_START + 7][BOARD_START + 5] = &BLACK_BISHOP;
     board[BOARD_START + 7][BOARD_START + 3] = &BLACK_QUEEN;
-    board[BOARD_START + 7][BOARD_START + 4] = &BLACK_KING
+    board[BOARD_START + 7][BOARD_START + 4] = &BLACK_KING;
 
     find_kings();
     enPassantFile[WHITE] = enPassantFile[BLACK] = -1;
@@ -288,11 +1067,87 @@ void init_board() {
 
     turn = WHITE;
     isRunning = true;
+    clear_tts();
+    announce("It's white's turn", TTS_INFO);
+    boardStatus = -1;
+    tablebaseAnnounced = false;
+    archive_new_game("");
 
     // Moves motors into place (ensure they're in the corner)
-    motor_move_both(-50, -50);
+    motor_move_both(-50, -50, false);
     motorRow = 0;
     motorCol = 0;
+    magnetState = 0;
+    publish_snapshot();
+}
+
+// Returns the standard piece matching a FEN letter (uppercase for white, lowercase for black)
+const struct piece *piece_from_fen(char c) {
+    switch(c) {
+        case 'P': return &WHITE_PAWN;
+        case 'N': return &WHITE_KNIGHT;
+        case 'B': return &WHITE_BISHOP;
+        case 'R': return &WHITE_ROOK;
+        case 'Q': return &WHITE_QUEEN;
+        case 'K': return &WHITE_KING;
+        case 'p': return &BLACK_PAWN;
+        case 'n': return &BLACK_KNIGHT;
+        case 'b': return &BLACK_BISHOP;
+        case 'r': return &BLACK_ROOK;
+        case 'q': return &BLACK_QUEEN;
+        case 'k': return &BLACK_KING;
+    }
+    return NULL;
+}
+
+// Sets up an arbitrary position from a FEN string, e.g. "rnbqkbnr/pppppppp/8/8/4P3/8/PPPP1PPP/RNBQKBNR b KQkq e3 0 1"
+// Only the placement field is required; side to move, castling rights and the en passant square are optional.
+// Like init_board(), this assumes the physical pieces already match, and leaves the perimeter empty.
+// Returns false (and leaves the board in an unspecified state) if the FEN can't be parsed.
+bool load_fen(char *fen) {
+    for(int rank = 0; rank < BOARD_SIZE; rank++) for(int file = 0; file < BOARD_SIZE; file++) board[rank][file] = &NULL_PIECE;
+
+    int rank = 7, file = 0;
+    char *c = fen;
+    for(; *c != '\0' && *c != ' '; c++) {
+        if(*c == '/') {
+            rank--;
+            file = 0;
+        } else if(*c >= '1' && *c <= '8') file += *c - '0';
+        else {
+            const struct piece *p = piece_from_fen(*c);
+            if(p == NULL || rank < 0 || file > 7) return false;
+            board[BOARD_START + rank][BOARD_START + file] = p;
+            file++;
+        }
+    }
+
+    turn = WHITE;
+    kingMoved[WHITE] = kingMoved[BLACK] = aRookMoved[WHITE] = aRookMoved[BLACK] = hRookMoved[WHITE] = hRookMoved[BLACK] = true;
+    enPassantFile[WHITE] = enPassantFile[BLACK] = -1;
+    while(*c == ' ') c++;
+    if(*c == 'b') turn = BLACK;
+    if(*c != '\0') c++;
+    while(*c == ' ') c++;
+    for(; *c != '\0' && *c != ' '; c++) { // Castling rights
+        if(*c == 'K') kingMoved[WHITE] = hRookMoved[WHITE] = false;
+        if(*c == 'Q') kingMoved[WHITE] = aRookMoved[WHITE] = false;
+        if(*c == 'k') kingMoved[BLACK] = hRookMoved[BLACK] = false;
+        if(*c == 'q') kingMoved[BLACK] = aRookMoved[BLACK] = false;
+    }
+    while(*c == ' ') c++;
+    if(*c >= 'a' && *c <= 'h') enPassantFile[other_colour(turn)] = *c - 'a'; // Indexed by the colour whose pawn just advanced two tiles
+
+    find_kings();
+    movesTillDraw = 100;
+    isRunning = true;
+    promote_letter = 'q';
+    clear_tts();
+    boardStatus = -1;
+    tablebaseAnnounced = false;
+    archive_new_game(fen);
+    publish_snapshot();
+    return true;
 }
 
 // Lowercase for white pieces and uppercase for black pieces
@@ -329,6 +1184,47 @@ void print_clone_board() {
     printf("[CLONE]\n");
 }
 
+// Writes the current state into the shared-memory snapshot, if one is open (see open_snapshot_channel())
+// Called after every move and every command the controller pops, so it has to stay cheap
+void publish_snapshot() {
+    if(snapshot == NULL) return;
+
+    uint32_t sequence = snapshot->sequence;
+    __atomic_store_n(&snapshot->sequence, sequence + 1, __ATOMIC_RELAXED); // Odd, readers back off
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    snapshot->turn = turn;
+    snapshot->status = boardStatus;
+    snapshot->running = isRunning;
+    snapshot->magnetOn = magnetState;
+
+    // The carriage is on its way to wherever the plan was before the pending commands
+    float row = motorRow, col = motorCol;
+    for(int i = 0; i < numCommandsInQueue; i++) {
+        if(commandQueue[i].commandType == X_MOTOR_AXIS) row -= commandQueue[i].f2;
+        else if(commandQueue[i].commandType == Y_MOTOR_AXIS) col -= commandQueue[i].f2;
+        else if(commandQueue[i].commandType == BOTH_MOTOR_AXES || commandQueue[i].commandType == PARK) {
+            row -= commandQueue[i].f1;
+            col -= commandQueue[i].f2;
+        }
+    }
+    snapshot->carriageRow = row;
+    snapshot->carriageCol = col;
+    snapshot->plannedRow = motorRow;
+    snapshot->plannedCol = motorCol;
+
+    snapshot->numCommands = numCommandsInQueue;
+    memcpy(snapshot->commands, commandQueue, sizeof(struct next_command) * numCommandsInQueue);
+    for(int i = 0; i < BOARD_SIZE; i++) {
+        for(int j = 0; j < BOARD_SIZE; j++) {
+            struct piece *p = board[i][j];
+            snapshot->board[i][j] = (p == NULL || piece_equal(p, &NULL_PIECE)) ? '.' : (p->colour == WHITE ? p->letter : p->letter + 32); // NULL before init_board()
+        }
+    }
+
+    __atomic_store_n(&snapshot->sequence, sequence + 2, __ATOMIC_RELEASE); // Even again, snapshot is consistent
+}
+
 // Returns the first empty spot on the chess board (useful for deciding where to put captured pieces)
 // "white" determines if we start searching for positions from white's side
 int first_empty_spot(bool white) {
@@ -342,18 +1238,9 @@ int first_empty_spot(bool white) {
     }
 }
 
-// "parsed" represents the char array to fill with the translated content
-// "input" represents the raw input from the user
-// For simplicity's sake, we're going to force the player to say the word "pawn" before moving a pawn
-// AVOID USING THE WORD "TO" AS A CONJUNCTION!
-void understand(char *parsed, char *input) {
-    // Turn everything to lowercase
-    for(int i = 0; i < strlen(input); i++) {
-        if(input[i] >= 'A' & input[i] <= 'Z') input[i] += 32;
-    }
-
-    // Locate the first occurrence of a word that could correspond to the name of a piece
-    // We've included similar words to capture speech-to-text errors (i.e., "pond" sounds like "pawn")
+// Locate the first occurrence of a word that could correspond to the name of a piece, or NULL if there is none
+// We've included similar words to capture speech-to-text errors (i.e., "pond" sounds like "pawn")
+char *find_piece_word(char *input) {
     char *pieceToMove = min_pointer(strstr(input, "pawn"), strstr(input, "pine"));
     pieceToMove = min_pointer(strstr(input, "pond"), pieceToMove);
     pieceToMove = min_pointer(strstr(input, "pain"), pieceToMove);
@@ -364,6 +1251,45 @@ void understand(char *parsed, char *input) {
     pieceToMove = min_pointer(strstr(input, "rook"), pieceToMove);
     pieceToMove = min_pointer(strstr(input, "queen"), pieceToMove);
     pieceToMove = min_pointer(strstr(input, "king"), pieceToMove);
+    return pieceToMove;
+}
+
+// Letter used in parsed moves for the piece named by find_piece_word()
+char piece_word_letter(char *pieceWord) { return prefix("horse", pieceWord) ? 'n' : pieceWord[0]; }
+
+// Collects the first two files (as letters) and the first two ranks (as numbers) mentioned in the input, in the order they were said
+void scan_squares(char *input, char *files, int *fileCnt, int *ranks, int *rankCnt) {
+    int totalIndexCnt = 2; // Keep track of which array slot to fill
+    *fileCnt = *rankCnt = 0;
+
+    for(int i = 0; i < strlen(input); i++) {
+        // Search for occurrences of terms that could be meant to denote files
+        if(*fileCnt < totalIndexCnt && (prefix(A_CODE, input + i) || prefix(B_CODE, input + i) || prefix(C_CODE, input + i) || prefix(D_CODE, input + i)
+            || prefix(E_CODE, input + i) || prefix(F_CODE, input + i) || prefix(G_CODE, input + i) || prefix(H_CODE, input + i))) files[(*fileCnt)++] = input[i];
+
+        // Search for occurrences of terms that could be meant to denote ranks
+        else if(*rankCnt < totalIndexCnt && (prefix("1", input + i) || prefix("one", input + i) || prefix("won", input + i))) ranks[(*rankCnt)++] = 1;
+        else if(*rankCnt < totalIndexCnt && (prefix("2", input + i) || prefix("two", input + i) || prefix("too", input + i) || prefix("to", input + i))) ranks[(*rankCnt)++] = 2;
+        else if(*rankCnt < totalIndexCnt && (prefix("3", input + i) || prefix("three", input + i))) ranks[(*rankCnt)++] = 3;
+        else if(*rankCnt < totalIndexCnt && (prefix("4", input + i) || prefix("four", input + i) || prefix("for", input + i))) ranks[(*rankCnt)++] = 4;
+        else if(*rankCnt < totalIndexCnt && (prefix("5", input + i) || prefix("five", input + i))) ranks[(*rankCnt)++] = 5;
+        else if(*rankCnt < totalIndexCnt && (prefix("6", input + i) || prefix("six", input + i) || prefix("stick", input + i))) ranks[(*rankCnt)++] = 6;
+        else if(*rankCnt < totalIndexCnt && (prefix("7", input + i) || prefix("seven", input + i))) ranks[(*rankCnt)++] = 7;
+        else if(*rankCnt < totalIndexCnt && (prefix("8", input + i) || prefix("eight", input + i) || prefix("ate", input + i))) ranks[(*rankCnt)++] = 8;
+    }
+}
+
+// "parsed" represents the char array to fill with the translated content
+// "input" represents the raw input from the user
+// For simplicity's sake, we're going to force the player to say the word "pawn" before moving a pawn
+// AVOID USING THE WORD "TO" AS A CONJUNCTION!
+void understand(char *parsed, char *input) {
+    // Turn everything to lowercase
+    for(int i = 0; i < strlen(input); i++) {
+        if(input[i] >= 'A' & input[i] <= 'Z') input[i] += 32;
+    }
+
+    char *pieceToMove = find_piece_word(input);
 
     // Look for the term "castle", which determines whether we should try to castle
     char *castle = strstr(input, "castle");
@@ -371,40 +1297,19 @@ void understand(char *parsed, char *input) {
         if(prefix("queen", pieceToMove)) strcpy(parsed, "o-o-o");
         else if(prefix("king", pieceToMove)) strcpy(parsed, "o-o");
     } else if (pieceToMove != NULL) {
-        int letterIndices [2] = {-1, -1}; // Files are letters!
-        int numberIndices [2] = {-1, -1}; // Ranks are numbers!
-        int letterIndexCnt = 0, numberIndexCnt = 0, totalIndexCnt = 2; // Keep track of which array slot to fill
-
-        for(int i = 0; i < strlen(input); i++) {
-            // Search for occurrences of terms that could be meant to denote files
-            if(prefix(A_CODE, input + i) && letterIndexCnt < totalIndexCnt) letterIndices[letterIndexCnt++] = i;
-            else if(prefix(B_CODE, input + i) && letterIndexCnt < totalIndexCnt) letterIndices[letterIndexCnt++] = i;
-            else if(prefix(C_CODE, input + i) && letterIndexCnt < totalIndexCnt) letterIndices[letterIndexCnt++] = i;
-            else if(prefix(D_CODE, input + i) && letterIndexCnt < totalIndexCnt) letterIndices[letterIndexCnt++] = i;
-            else if(prefix(E_CODE, input + i) && letterIndexCnt < totalIndexCnt) letterIndices[letterIndexCnt++] = i;
-            else if(prefix(F_CODE, input + i) && letterIndexCnt < totalIndexCnt) letterIndices[letterIndexCnt++] = i;
-            else if(prefix(G_CODE, input + i) && letterIndexCnt < totalIndexCnt) letterIndices[letterIndexCnt++] = i;
-            else if(prefix(H_CODE, input + i) && letterIndexCnt < totalIndexCnt) letterIndices[letterIndexCnt++] = i;
-
-            // Search for occurrences of terms that could be meant to denote ranks
-            else if(numberIndexCnt < totalIndexCnt && (prefix("1", input + i) || prefix("one", input + i) || prefix("won", input + i))) numberIndices[numberIndexCnt++] = 1;
-            else if(numberIndexCnt < totalIndexCnt && (prefix("2", input + i) || prefix("two", input + i) || prefix("too", input + i) || prefix("to", input + i))) numberIndices[numberIndexCnt++] = 2;
-            else if(numberIndexCnt < totalIndexCnt && (prefix("3", input + i) || prefix("three", input + i))) numberIndices[numberIndexCnt++] = 3;
-            else if(numberIndexCnt < totalIndexCnt && (prefix("4", input + i) || prefix("four", input + i) || prefix("for", input + i))) numberIndices[numberIndexCnt++] = 4;
-            else if(numberIndexCnt < totalIndexCnt && (prefix("5", input + i) || prefix("five", input + i))) numberIndices[numberIndexCnt++] = 5;
-            else if(numberIndexCnt < totalIndexCnt && (prefix("6", input + i) || prefix("six", input + i) || prefix("stick", input + i))) numberIndices[numberIndexCnt++] = 6;
-            else if(numberIndexCnt < totalIndexCnt && (prefix("7", input + i) || prefix("seven", input + i))) numberIndices[numberIndexCnt++] = 7;
-            else if(numberIndexCnt < totalIndexCnt && (prefix("8", input + i) || prefix("eight", input + i) || prefix("ate", input + i))) numberIndices[numberIndexCnt++] = 8;
-        }
+        char files [2]; // Files are letters!
+        int ranks [2]; // Ranks are numbers!
+        int fileCnt, rankCnt;
+        scan_squares(input, files, &fileCnt, ranks, &rankCnt);
 
         // Update parsed file and rank information
-        if(letterIndexCnt > 0 && numberIndexCnt > 0) {
+        if(fileCnt > 0 && rankCnt > 0) {
             char newParsed [6];
-            newParsed[0] = (prefix("horse", pieceToMove) ? 'n' : pieceToMove[0]);
-            newParsed[1] = letterIndexCnt > 1 ? input[letterIndices[0]] : '$';
-            newParsed[2] = numberIndexCnt > 1 ? numberIndices[0] + '0' : '$';
-            newParsed[3] = letterIndexCnt > 1 ? input[letterIndices[1]] : input[letterIndices[0]];
-            newParsed[4] = numberIndexCnt > 1 ? numberIndices[1] + '0' : numberIndices[0] + '0';
+            newParsed[0] = piece_word_letter(pieceToMove);
+            newParsed[1] = fileCnt > 1 ? files[0] : '$';
+            newParsed[2] = rankCnt > 1 ? ranks[0] + '0' : '$';
+            newParsed[3] = fileCnt > 1 ? files[1] : files[0];
+            newParsed[4] = rankCnt > 1 ? ranks[1] + '0' : ranks[0] + '0';
             newParsed[5] = '\0';
             strcpy(parsed, newParsed);
 
@@ -440,18 +1345,20 @@ bool legal_move(int srcRank, int srcFile, int destRank, int destFile) {
     bool isCapture = !piece_equal(destPiece, &NULL_PIECE); // Whether this move is considered a capture
 
     if(srcPiece->pieceId == PAWN_ID) {
-        if(enPassantFile[other_colour(srcPiece->colour)] == destFile && abs(srcFile - destFile) == 1 && ((srcPiece->colour == white && destRank - srcRank == 1)
-            || (srcPiece->colour == black && srcRank - destRank == 1)) && !isCapture && board[BOARD_START + srcRank][BOARD_START + destFile]->pieceId == PAWN_ID) { // En passant
+        if(enPassantFile[other_colour(srcPiece->colour)] == destFile && abs(srcFile - destFile) == 1 && ((srcPiece->colour == WHITE && destRank - srcRank == 1)
+            || (srcPiece->colour == BLACK && srcRank - destRank == 1)) && !isCapture && srcRank == (srcPiece->colour == WHITE ? 4 : 3)
+            && board[BOARD_START + srcRank][BOARD_START + destFile]->pieceId == PAWN_ID && board[BOARD_START + srcRank][BOARD_START + destFile]->colour != srcPiece->colour) { // En passant
             return true;
         }
         if(srcFile == destFile && !isCapture) { // Advance forwards, with no capture
-            if((srcPiece->colour == white && destRank <= srcRank) || (srcPiece->colour == black && destRank >= srcRank)) return false; // No moving backwards!
+            if((srcPiece->colour == WHITE && destRank <= srcRank) || (srcPiece->colour == BLACK && destRank >= srcRank)) return false; // No moving backwards!
 
             int distMoved = abs(srcRank - destRank);
-            if(distMoved == 2 && ((srcPiece->colour == white && srcRank == 1) || (srcPiece->colour == black && srcRank == 6))) return true; // Two square pawn advance from start
+            if(distMoved == 2 && ((srcPiece->colour == WHITE && srcRank == 1) || (srcPiece->colour == BLACK && srcRank == 6))) // Two square pawn advance from start, if nothing is in the way
+                return piece_equal(board[BOARD_START + (srcRank + destRank) / 2][BOARD_START + srcFile], &NULL_PIECE);
             else if(distMoved == 1) return true; // One square advance
         } else if(abs(srcFile - destFile) == 1) { // Diagonal capture
-            if(((srcPiece->colour == white && destRank - srcRank == 1) || (srcPiece->colour == black && srcRank - destRank == 1)) && isCapture) return true; // Diagonal capture on pawn
+            if(((srcPiece->colour == WHITE && destRank - srcRank == 1) || (srcPiece->colour == BLACK && srcRank - destRank == 1)) && isCapture) return true; // Diagonal capture on pawn
         }
         return false;
     }
@@ -519,54 +1426,203 @@ bool tile_attacked(int targetRank, int targetFile, int colour) {
     return false;
 }
 
-// Whether queen-side castling is legal
-bool legal_castle_queenside(int colour) {
+// Whether the given colour may castle on the given side, without announcing anything
+bool castle_available(int colour, bool kingSide) {
     int targetRank = (colour == WHITE ? 0 : 7);
-    if(!(tile_attacked(targetRank, 2, colour) || tile_attacked(targetRank, 3, colour) || tile_attacked(targetRank, 4, colour))) { // Tiles king would pass through can't be under attack
-        if(!(aRookMoved[colour] || kingMoved[colour])) { // Pieces already moved
-            if(piece_equal(board[BOARD_START + targetRank][BOARD_START + 1], &NULL_PIECE) && piece_equal(board[BOARD_START + targetRank][BOARD_START + 2], &NULL_PIECE) && piece_equal(board[BOARD_START + targetRank][BOARD_START + 3], &NULL_PIECE)) { // No obstructing pieces
-                return true;
-            }
-        }
+    if(kingMoved[colour] || (kingSide ? hRookMoved[colour] : aRookMoved[colour])) return false; // Pieces already moved
+
+    for(int file = (kingSide ? 4 : 2); file <= (kingSide ? 6 : 4); file++) { // Tiles king would pass through can't be under attack
+        if(tile_attacked(targetRank, file, colour)) return false;
+    }
+    for(int file = (kingSide ? 5 : 1); file <= (kingSide ? 6 : 3); file++) { // No obstructing pieces
+        if(!piece_equal(board[BOARD_START + targetRank][BOARD_START + file], &NULL_PIECE)) return false;
     }
+    return true;
+}
+
+// Whether queen-side castling is legal
+bool legal_castle_queenside(int colour) {
+    if(castle_available(colour, false)) return true;
     print_tts_message("Can't castle now.\n");
     return false;
 }
 
 // Whether king-side castling is legal
 bool legal_castle_kingside(int colour) {
-    int targetRank = (colour == WHITE ? 0 : 7);
-    if(!(tile_attacked(targetRank, 4, colour) || tile_attacked(targetRank, 5, colour) || tile_attacked(targetRank, 6, colour))) { // Tiles king would pass through can't be under attack
-        if(!(hRookMoved[colour] || kingMoved[colour])) { // Pieces already moved
-            if(piece_equal(board[BOARD_START + targetRank][BOARD_START + 5], &NULL_PIECE) && piece_equal(board[BOARD_START + targetRank][BOARD_START + 6], &NULL_PIECE)) { // No obstructing pieces
-                return true;
-            }
-        }
-    }
+    if(castle_available(colour, true)) return true;
     print_tts_message("Can't castle now.\n");
     return false;
 }
 
-// See validate_input() for details (format should be "ra1h3")
-// This function ensures that notation is correct (identified the correct piece, etc.)
-bool validate_move(char *input, int turn) {
-    // Handle castling separately
-    if(!strcmp(input, "o-o")) return legal_castle_kingside(turn);
-    else if(!strcmp(input, "o-o-o")) return legal_castle_queenside(turn);
+// Returns true if the given colour's king is currently under threat
+bool under_check(int colour) {
+    return tile_attacked(kingRank[colour], kingFile[colour], colour);
+}
 
-    if(input[1] == '$') { // Variable file
-        for(int i = 0; i < 8; i++) { // Test all files
-            input[1] = 'a' + i;
-            if(validate_move(input, turn)) return true;
-        }
-        return false;
-    } else if (input[2] == '$') { // Variable rank, file fixed
-        for(int i = 0; i < 8; i++) { // Test all ranks
-            input[2] = '1' + i;
-            if(validate_move(input, turn)) return true;
+// Whether moving the piece at [srcRank][srcFile] to [destRank][destFile] keeps its own king out of check
+// The move is simulated and then reverted, as in has_valid_move(); an en passant victim is taken off the board too
+bool leaves_king_safe(int srcRank, int srcFile, int destRank, int destFile, int colour) {
+    struct piece *src = board[BOARD_START + srcRank][BOARD_START + srcFile];
+    struct piece *dest = board[BOARD_START + destRank][BOARD_START + destFile];
+    struct piece *adj = board[BOARD_START + srcRank][BOARD_START + destFile]; // Potential en passant victim
+    bool enPassant = src->pieceId == PAWN_ID && srcFile != destFile && piece_equal(dest, &NULL_PIECE);
+
+    board[BOARD_START + destRank][BOARD_START + destFile] = src;
+    board[BOARD_START + srcRank][BOARD_START + srcFile] = &NULL_PIECE;
+    if(enPassant) board[BOARD_START + srcRank][BOARD_START + destFile] = &NULL_PIECE;
+    find_kings();
+
+    bool safe = !under_check(colour);
+
+    board[BOARD_START + srcRank][BOARD_START + destFile] = adj;
+    board[BOARD_START + destRank][BOARD_START + destFile] = dest;
+    board[BOARD_START + srcRank][BOARD_START + srcFile] = src;
+    find_kings();
+    return safe;
+}
+
+// Reverse attack tables, indexed by square (rank * 8 + file, within the playable area)
+// Knights and kings move symmetrically, so the squares a piece could attack from a square are also the squares it could come from
+uint64_t knightSources [64];
+uint64_t kingSources [64];
+
+// Squares along each direction from a square, nearest first
+// Directions 0-3 are straight (rooks and queens), 4-7 are diagonal (bishops and queens)
+const int RAY_DELTA_RANK [8] = {1, -1, 0, 0, 1, 1, -1, -1};
+const int RAY_DELTA_FILE [8] = {0, 0, 1, -1, 1, -1, 1, -1};
+int raySquares [64][8][7];
+int rayLength [64][8];
+bool attackTablesBuilt = false;
+
+void build_attack_tables() {
+    const int knightDeltaRank [8] = {1, 2, 2, 1, -1, -2, -2, -1};
+    const int knightDeltaFile [8] = {2, 1, -1, -2, -2, -1, 1, 2};
+
+    for(int square = 0; square < 64; square++) {
+        int rank = square / 8, file = square % 8;
+        knightSources[square] = kingSources[square] = 0;
+
+        for(int i = 0; i < 8; i++) {
+            int r = rank + knightDeltaRank[i], f = file + knightDeltaFile[i];
+            if(r >= 0 && r < 8 && f >= 0 && f < 8) knightSources[square] |= 1ULL << (r * 8 + f);
+
+            r = rank + RAY_DELTA_RANK[i];
+            f = file + RAY_DELTA_FILE[i];
+            if(r >= 0 && r < 8 && f >= 0 && f < 8) kingSources[square] |= 1ULL << (r * 8 + f);
+
+            rayLength[square][i] = 0;
+            for(; r >= 0 && r < 8 && f >= 0 && f < 8; r += RAY_DELTA_RANK[i], f += RAY_DELTA_FILE[i]) raySquares[square][i][rayLength[square][i]++] = r * 8 + f;
         }
-        input[2] = '$'; // Reset, in case further files need the rank iteration again
-        return false;
+    }
+    attackTablesBuilt = true;
+}
+
+// Finds every square from which the given colour's piece of the given type can legally move to [destRank][destFile]
+// Only the squares the reverse attack tables point at are tried, rather than the whole board
+// Sources are written as rank * 8 + file (ranks and files within [0, 8)); returns how many there are
+int find_move_sources(int pieceId, int colour, int destRank, int destFile, int *sources) {
+    if(!attackTablesBuilt) build_attack_tables();
+
+    int dest = destRank * 8 + destFile;
+    int candidates [16];
+    int numCandidates = 0;
+
+    if(pieceId == KNIGHT_ID || pieceId == KING_ID) {
+        for(uint64_t from = (pieceId == KNIGHT_ID ? knightSources[dest] : kingSources[dest]); from != 0; from &= from - 1) candidates[numCandidates++] = __builtin_ctzll(from);
+    } else if(pieceId == PAWN_ID) { // Advances and captures, looking back the way the pawn came
+        int back = (colour == WHITE ? -1 : 1);
+        for(int rank = destRank + back, steps = 1; steps <= 2 && rank >= 0 && rank < 8; rank += back, steps++) {
+            candidates[numCandidates++] = rank * 8 + destFile;
+            if(!piece_equal(board[BOARD_START + rank][BOARD_START + destFile], &NULL_PIECE)) break; // Nothing jumps over this one
+        }
+        for(int file = destFile - 1; file <= destFile + 1; file += 2) {
+            if(file >= 0 && file < 8 && destRank + back >= 0 && destRank + back < 8) candidates[numCandidates++] = (destRank + back) * 8 + file;
+        }
+    } else { // Sliding pieces, only the first piece along each ray can get here
+        for(int direction = (pieceId == BISHOP_ID ? 4 : 0); direction < (pieceId == ROOK_ID ? 4 : 8); direction++) {
+            for(int i = 0; i < rayLength[dest][direction]; i++) {
+                int square = raySquares[dest][direction][i];
+                if(!piece_equal(board[BOARD_START + square / 8][BOARD_START + square % 8], &NULL_PIECE)) {
+                    candidates[numCandidates++] = square;
+                    break;
+                }
+            }
+        }
+    }
+
+    int numSources = 0;
+    for(int i = 0; i < numCandidates; i++) {
+        int rank = candidates[i] / 8, file = candidates[i] % 8;
+        struct piece *p = board[BOARD_START + rank][BOARD_START + file];
+        if(p->pieceId != pieceId || p->colour != colour) continue;
+        if(!legal_move(rank, file, destRank, destFile) || !leaves_king_safe(rank, file, destRank, destFile, colour)) continue;
+
+        int j = numSources++; // Keep sources in board order (a1, b1, ..., h8)
+        for(; j > 0 && sources[j - 1] > candidates[i]; j--) sources[j] = sources[j - 1];
+        sources[j] = candidates[i];
+    }
+    return numSources;
+}
+
+// Spoken word for a file, see A_CODE etc.
+const char *file_code(int file) {
+    const char *codes [8] = {A_CODE, B_CODE, C_CODE, D_CODE, E_CODE, F_CODE, G_CODE, H_CODE};
+    return codes[file];
+}
+
+// Whether the last call to validate_move() failed because more than one piece could have been meant
+bool moveAmbiguous = false;
+
+// Asks the player which of several pieces they meant, e.g. "Which knight, banana or garlic?"
+// Pieces are told apart by file, or by file and rank if two of them share a file
+void ask_which_piece(int pieceId, int *sources, int numSources) {
+    const char *names [6] = {"pawn", "knight", "bishop", "rook", "queen", "king"};
+    bool sameFile = false;
+    for(int i = 0; i < numSources; i++) {
+        for(int j = i + 1; j < numSources; j++) sameFile = sameFile || sources[i] % 8 == sources[j] % 8;
+    }
+
+    char question [TTS_MESSAGE_LENGTH];
+    int length = snprintf(question, sizeof(question), "Which %s, ", names[pieceId]);
+    for(int i = 0; i < numSources && length < (int) sizeof(question); i++) {
+        const char *separator = (i == 0 ? "" : (i == numSources - 1 ? " or " : ", "));
+        if(sameFile) length += snprintf(question + length, sizeof(question) - length, "%s%s %d", separator, file_code(sources[i] % 8), sources[i] / 8 + 1);
+        else length += snprintf(question + length, sizeof(question) - length, "%s%s", separator, file_code(sources[i] % 8));
+    }
+    if(length < (int) sizeof(question)) snprintf(question + length, sizeof(question) - length, "?");
+    print_tts_message(question);
+}
+
+// See validate_input() for details (format should be "ra1h3")
+// This function ensures that notation is correct (identified the correct piece, etc.)
+// A source left out by the player ('$') is filled in, unless several pieces fit, in which case the player is asked which one
+bool validate_move(char *input, int turn) {
+    moveAmbiguous = false;
+
+    // Handle castling separately
+    if(!strcmp(input, "o-o")) return legal_castle_kingside(turn);
+    else if(!strcmp(input, "o-o-o")) return legal_castle_queenside(turn);
+
+    if(input[1] == '$' || input[2] == '$') { // Variable file and/or rank
+        const struct piece *named = piece_from_fen(input[0]);
+        if(named == NULL) return false;
+
+        int sources [16];
+        int numSources = find_move_sources(named->pieceId, turn, input[4] - '1', input[3] - 'a', sources);
+        int numMatching = 0;
+        for(int i = 0; i < numSources; i++) { // Keep those that agree with whatever part of the source was given
+            if((input[1] == '$' || input[1] == 'a' + sources[i] % 8) && (input[2] == '$' || input[2] == '1' + sources[i] / 8)) sources[numMatching++] = sources[i];
+        }
+
+        if(numMatching == 0) return false;
+        if(numMatching > 1) {
+            moveAmbiguous = true;
+            ask_which_piece(named->pieceId, sources, numMatching);
+            return false;
+        }
+        input[1] = 'a' + sources[0] % 8;
+        input[2] = '1' + sources[0] / 8;
+        return true;
     }
 
     struct piece *toMove = board[BOARD_START + input[2] - '1'][BOARD_START + input[1] - 'a'];
@@ -574,11 +1630,6 @@ bool validate_move(char *input, int turn) {
     return false;
 }
 
-// Returns true if the given colour's king is currently under threat
-bool under_check(int colour) {
-    return tile_attacked(kingRank[colour], kingFile[colour], colour);
-}
-
 // Given the current board state, determines if the given colour has a valid move
 bool has_valid_move(int colour) {
     bool moveAvailable = false; // Whether a valid move exists
@@ -617,18 +1668,222 @@ bool has_valid_move(int colour) {
     return moveAvailable;
 }
 
+// Fills "moves" with every legal move for the given colour, in the notation produced by understand(), and returns how many there are
+int generate_legal_moves(int colour, char moves [][6]) {
+    int numMoves = 0;
+
+    for(int srcRank = 0; srcRank < 8; srcRank++) {
+        for(int srcFile = 0; srcFile < 8; srcFile++) {
+            struct piece *src = board[BOARD_START + srcRank][BOARD_START + srcFile];
+            if(src->colour != colour) continue; // Opponent piece or open tile
+
+            for(int destRank = 0; destRank < 8; destRank++) {
+                for(int destFile = 0; destFile < 8; destFile++) {
+                    if(!legal_move(srcRank, srcFile, destRank, destFile) || !leaves_king_safe(srcRank, srcFile, destRank, destFile, colour)) continue;
+
+                    if(numMoves < MAX_CANDIDATES) {
+                        char *move = moves[numMoves++];
+                        move[0] = src->letter + 32;
+                        move[1] = 'a' + srcFile;
+                        move[2] = '1' + srcRank;
+                        move[3] = 'a' + destFile;
+                        move[4] = '1' + destRank;
+                        move[5] = '\0';
+                    }
+                }
+            }
+        }
+    }
+
+    if(castle_available(colour, true) && numMoves < MAX_CANDIDATES) strcpy(moves[numMoves++], "o-o");
+    if(castle_available(colour, false) && numMoves < MAX_CANDIDATES) strcpy(moves[numMoves++], "o-o-o");
+    return numMoves;
+}
+
+// Collects the pieces on the playable board for a tablebase lookup
+// Returns how many there are, or -1 if there are more than TB_MAX_PIECES
+int tablebase_pieces(struct tb_piece *pieces) {
+    int numPieces = 0;
+    for(int rank = 0; rank < 8; rank++) {
+        for(int file = 0; file < 8; file++) {
+            struct piece *p = board[BOARD_START + rank][BOARD_START + file];
+            if(piece_equal(p, &NULL_PIECE)) continue;
+            if(numPieces == TB_MAX_PIECES) return -1;
+            struct tb_piece found = {p->pieceId, p->colour, rank * 8 + file};
+            pieces[numPieces++] = found;
+        }
+    }
+    return numPieces;
+}
+
+// Looks up the current position for the player to move (see TB_DRAW etc.)
+// TB_UNKNOWN if no table covers it: too many pieces, castling or en passant still possible, or no tables at all
+int tablebase_probe() {
+    if(tablebaseDirectory[0] == '\0' || enPassantFile[WHITE] != -1 || enPassantFile[BLACK] != -1) return TB_UNKNOWN;
+    for(int colour = WHITE; colour <= BLACK; colour++) {
+        if(!kingMoved[colour] && (!aRookMoved[colour] || !hRookMoved[colour])) return TB_UNKNOWN;
+    }
+
+    struct tb_piece pieces [TB_MAX_PIECES];
+    int numPieces = tablebase_pieces(pieces);
+    if(numPieces < 0) return TB_UNKNOWN;
+    return tablebase_probe_pieces(pieces, numPieces, turn);
+}
+
+// Perfect play for the engine side: writes the move the tables recommend for the player to move into "parsed"
+// (notation produced by understand()) and sets promote_letter to go with it.
+// Wins are converted as quickly as possible and losses are dragged out as long as possible.
+// Returns false if no table covers the position.
+bool tablebase_best_move(char *parsed) {
+    if(!tablebase_is_result(tablebase_probe())) return false;
+
+    struct tb_piece pieces [TB_MAX_PIECES];
+    int numPieces = tablebase_pieces(pieces);
+    char moves [MAX_CANDIDATES][6];
+    int numMoves = generate_legal_moves(turn, moves); // No castling, or the probe above would have failed
+    const char promotions [4] = {'q', 'r', 'b', 'n'};
+    const int promotionIds [4] = {QUEEN_ID, ROOK_ID, BISHOP_ID, KNIGHT_ID};
+
+    int bestScore = -1000000;
+    for(int i = 0; i < numMoves; i++) {
+        int src = (moves[i][2] - '1') * 8 + moves[i][1] - 'a';
+        int dest = (moves[i][4] - '1') * 8 + moves[i][3] - 'a';
+        bool promotion = moves[i][0] == 'p' && (dest / 8 == 0 || dest / 8 == 7);
+
+        for(int p = 0; p < (promotion ? 4 : 1); p++) {
+            struct tb_piece after [TB_MAX_PIECES]; // Position after the move, without touching the board
+            int numAfter = 0;
+            for(int j = 0; j < numPieces; j++) {
+                if(pieces[j].square == dest) continue; // Captured
+                after[numAfter] = pieces[j];
+                if(pieces[j].square == src) {
+                    after[numAfter].square = dest;
+                    if(promotion) after[numAfter].pieceId = promotionIds[p];
+                }
+                numAfter++;
+            }
+
+            int value = tablebase_probe_pieces(after, numAfter, other_colour(turn)); // From the opponent's point of view
+            if(!tablebase_is_result(value)) continue;
+            int score = 0;
+            if(value < 0) score = 1000 - tablebase_plies(value); // Opponent loses, sooner is better
+            else if(value > 0) score = -1000 + tablebase_plies(value); // Opponent wins, later is better
+
+            if(score > bestScore) {
+                bestScore = score;
+                strcpy(parsed, moves[i]);
+                promote_letter = promotions[p];
+            }
+        }
+    }
+    return bestScore > -1000000;
+}
+
+// Tells the players what the tables say as soon as the position is covered by one:
+// a forced mate is announced once per game, and a draw ends the game right away (unless adjudication is turned off)
+void announce_tablebase_result() {
+    int value = tablebase_probe();
+    if(!tablebase_is_result(value) || value == -1) return; // Not covered, or already checkmate
+
+    if(value == TB_DRAW) {
+        if(!tablebaseAdjudication) return;
+        announce("Tablebase draw. Game is tied.", TTS_GAME_OVER);
+        isRunning = false;
+        return;
+    }
+    if(tablebaseAnnounced) return;
+
+    char message [TTS_MESSAGE_LENGTH];
+    int winner = value > 0 ? turn : other_colour(turn);
+    snprintf(message, sizeof(message), "%s mates in %d.", winner == WHITE ? "White" : "Black", (tablebase_plies(value) + 1) / 2);
+    announce(message, TTS_ALERT);
+    tablebaseAnnounced = true;
+}
+
+// To be called when the player starts speaking a new move
+void begin_utterance() {
+    traceTurn++;
+    numCandidates = numCandidatesLeft = generate_legal_moves(turn, candidateMoves);
+}
+
+// Whether a candidate move could still be what the player is saying, given the piece, files and ranks heard so far
+// Squares are either said in full ("eggplant 2 eggplant 4") or as just the destination ("eggplant 4"), see understand()
+bool candidate_consistent(char *move, char pieceLetter, char *files, int fileCnt, int *ranks, int rankCnt) {
+    if(move[0] != pieceLetter) return false;
+
+    bool fullForm = true;
+    for(int i = 0; i < fileCnt; i++) fullForm = fullForm && files[i] == move[1 + 2 * i];
+    for(int i = 0; i < rankCnt; i++) fullForm = fullForm && ranks[i] == move[2 + 2 * i] - '0';
+
+    bool destinationOnly = fileCnt <= 1 && rankCnt <= 1 && (fileCnt == 0 || files[0] == move[3]) && (rankCnt == 0 || ranks[0] == move[4] - '0');
+    return fullForm || destinationOnly;
+}
+
+// Incremental version of understand(), to be fed every partial hypothesis of the utterance started with begin_utterance()
+// Returns true once exactly one legal move is consistent with what has been heard, and writes it into "parsed"
+// Nothing is committed before the piece, a file and a rank have been heard (the same minimum understand() needs),
+// and promotions wait for the final hypothesis since the piece to promote to is said last
+bool understand_partial(char *parsed, char *input) {
+    char heard [256];
+    strncpy(heard, input, sizeof(heard) - 1);
+    heard[sizeof(heard) - 1] = '\0';
+    for(size_t i = 0, n = strlen(heard); i < n; i++) {
+        if(heard[i] >= 'A' && heard[i] <= 'Z') heard[i] += 32;
+    }
+    strcpy(parsed, "");
+
+    char *pieceWord = find_piece_word(heard);
+    if(pieceWord == NULL) {
+        numCandidatesLeft = numCandidates;
+        return false;
+    }
+
+    if(strstr(heard, "castle") != NULL) { // Only castling fits from here on
+        char *castle = prefix("queen", pieceWord) ? "o-o-o" : (prefix("king", pieceWord) ? "o-o" : NULL);
+        numCandidatesLeft = 0;
+        for(int i = 0; i < numCandidates && castle != NULL; i++) {
+            if(!strcmp(candidateMoves[i], castle)) {
+                numCandidatesLeft = 1;
+                strcpy(parsed, castle);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    char files [2];
+    int ranks [2];
+    int fileCnt, rankCnt;
+    scan_squares(heard, files, &fileCnt, ranks, &rankCnt);
+
+    char pieceLetter = piece_word_letter(pieceWord);
+    int match = -1;
+    numCandidatesLeft = 0;
+    for(int i = 0; i < numCandidates; i++) {
+        if(candidate_consistent(candidateMoves[i], pieceLetter, files, fileCnt, ranks, rankCnt)) {
+            numCandidatesLeft++;
+            match = i;
+        }
+    }
+
+    if(numCandidatesLeft != 1 || fileCnt == 0 || rankCnt == 0) return false;
+    if(pieceLetter == 'p' && (candidateMoves[match][4] == '1' || candidateMoves[match][4] == '8')) return false; // Promotion
+    strcpy(parsed, candidateMoves[match]);
+    return true;
+}
+
 // Motor will move the given distance ACROSS rows
 void motor_move_row(float delta) {
     motorRow += delta;
     queue_command(X_MOTOR_AXIS, 0, 0, delta);
-    printf("[DEBUG] $MOTOR$ moved in Y: %f tiles\n", delta);
+    if(debugLogging) printf("[DEBUG] $MOTOR$ moved in Y: %f tiles\n", delta);
 }
 
 // Motor will move the given distance ALONG rows
 void motor_move_col(float delta) {
     motorCol += delta;
     queue_command(Y_MOTOR_AXIS, 0, 0, delta);
-    printf("[DEBUG] $MOTOR$ moved in X: %f tiles\n", delta);
+    if(debugLogging) printf("[DEBUG] $MOTOR$ moved in X: %f tiles\n", delta);
 }
 
 void motor_move_both(float deltaX, float deltaY, bool withOverflow) {
@@ -636,7 +1891,7 @@ void motor_move_both(float deltaX, float deltaY, bool withOverflow) {
     motorCol += deltaY;
 
     queue_command(BOTH_MOTOR_AXES, 0, deltaX, deltaY);
-    printf("[DEBUG] $MOTOR$ moved in two axes: %f, %f tiles\n", deltaX, deltaY);
+    if(debugLogging) printf("[DEBUG] $MOTOR$ moved in two axes: %f, %f tiles\n", deltaX, deltaY);
 }
 
 // Our motors aren't precise enough, so we'll recalibrate the motor in between movements (call at the end of command chain)
@@ -645,11 +1900,108 @@ void motor_reset() {
         motor_move_both(-motorRow, -motorCol, false);
 }
 
+// Idle positioning: once a move is done, the carriage waits wherever the next move most likely starts
+// Each legal move of the side to move counts once, plus the value of what it captures (players take material far more
+// often than a uniform pick would), and the move the tablebases recommend counts as much as all the others together.
+// The carriage parks on the tile that minimises the weighted distance to the source squares, both axes moving at once.
+bool idleParking = true;
+void set_idle_parking(bool enabled) { idleParking = enabled; }
+const float PARK_MIN_GAIN = 0.5f; // Tiles of expected travel the park has to save to be worth making
+float parkedFromRow = 0; // Where the plan left the carriage before it was parked, so the park can be taken back
+float parkedFromCol = 0;
+
+// Expected tiles of travel from (row, col) to the next move's source square
+float expected_travel(float weights [8][8], float totalWeight, float row, float col) {
+    float travel = 0;
+    for(int rank = 0; rank < 8; rank++) {
+        for(int file = 0; file < 8; file++) {
+            if(weights[rank][file] == 0) continue;
+            float distance = fmaxf(fabsf(BOARD_START + rank - row), fabsf(BOARD_START + file - col));
+            travel += weights[rank][file] * distance;
+        }
+    }
+    return travel / totalWeight;
+}
+
+void park_carriage() {
+    if(!idleParking || !isRunning || numCommandsInQueue >= COMMAND_QUEUE_SIZE) return;
+    const int values [6] = {1, 3, 3, 5, 9, 0}; // Indexed by piece id
+
+    char moves [MAX_CANDIDATES][6];
+    int numMoves = generate_legal_moves(turn, moves);
+    if(numMoves == 0) return;
+    float weights [8][8] = {0};
+    float totalWeight = 0;
+    for(int i = 0; i < numMoves; i++) {
+        int srcRank = turn == WHITE ? 0 : 7, srcFile = 4; // Castling starts from the king
+        float weight = 1;
+        if(moves[i][0] != 'o') {
+            srcRank = moves[i][2] - '1';
+            srcFile = moves[i][1] - 'a';
+            struct piece *captured = board[BOARD_START + moves[i][4] - '1'][BOARD_START + moves[i][3] - 'a'];
+            if(!piece_equal(captured, &NULL_PIECE)) weight += values[captured->pieceId];
+        }
+        weights[srcRank][srcFile] += weight;
+        totalWeight += weight;
+    }
+    char best [10];
+    char promotion = promote_letter; // Left alone, the player hasn't asked for anything yet
+    if(tablebase_best_move(best) && best[0] != 'o') {
+        weights[best[2] - '1'][best[1] - 'a'] += totalWeight;
+        totalWeight *= 2;
+    }
+    promote_letter = promotion;
+
+    float current = expected_travel(weights, totalWeight, motorRow, motorCol);
+    float bestTravel = current, bestDistance = 0;
+    int bestRow = -1, bestCol = -1;
+    for(int row = 0; row < BOARD_SIZE; row++) {
+        for(int col = 0; col < BOARD_SIZE; col++) {
+            float travel = expected_travel(weights, totalWeight, row, col);
+            float distance = fmaxf(fabsf(row - motorRow), fabsf(col - motorCol)); // Ties go to the shortest park
+            if(travel < bestTravel - 0.001f || (bestRow != -1 && travel < bestTravel + 0.001f && distance < bestDistance)) {
+                bestTravel = travel;
+                bestDistance = distance;
+                bestRow = row;
+                bestCol = col;
+            }
+        }
+    }
+    if(bestRow == -1 || current - bestTravel < PARK_MIN_GAIN) return;
+
+    parkedFromRow = motorRow;
+    parkedFromCol = motorCol;
+    queue_command(PARK, 0, bestRow - motorRow, bestCol - motorCol);
+    motorRow = bestRow;
+    motorCol = bestCol;
+    if(debugLogging) printf("[DEBUG] $MOTOR$ parked at %d, %d: %.2f tiles to the next move expected, down from %.2f\n", bestRow, bestCol, bestTravel, current);
+}
+
+// Takes the park back if the controller hasn't picked it up yet, so the next plan starts from where the carriage really is
+// A park the controller has already started is abandoned on its side (see motion.py)
+void cancel_park() {
+    if(numCommandsInQueue == 0 || commandQueue[numCommandsInQueue - 1].commandType != PARK) return;
+    numCommandsInQueue--;
+    motorRow = parkedFromRow;
+    motorCol = parkedFromCol;
+}
+
+// Piece under the carriage when the magnet was last switched on, or -1 if none
+// Magnet commands carry it in f1, so the controller can wait just as long as that piece takes to settle
+int magnetPieceId = -1;
+
+int piece_under_carriage(struct piece *layout [BOARD_SIZE][BOARD_SIZE], float row, float col) {
+    int r = (int) roundf(row), c = (int) roundf(col);
+    if(r < 0 || r >= BOARD_SIZE || c < 0 || c >= BOARD_SIZE) return -1;
+    return layout[r][c]->pieceId;
+}
+
 // Turns the electromagnet on/off
 void toggle_magnet(bool state) {
     int toggle = state ? 1 : 0;
-    queue_command(MAGNET_TOGGLE, toggle, 0, 0);
-    printf(state ? "[DEBUG] $MAGNET$: ON\n" : "[DEBUG] $MAGNET$: OFF\n");
+    if(state) magnetPieceId = piece_under_carriage(board_clone, motorRow, motorCol);
+    queue_command(MAGNET_TOGGLE, toggle, magnetPieceId, 0);
+    if(debugLogging) printf(state ? "[DEBUG] $MAGNET$: ON\n" : "[DEBUG] $MAGNET$: OFF\n");
 }
 
 // Identify all the tiles that can be reached from this tile
@@ -664,7 +2016,7 @@ void initial_spread(int *visited, int startRank, int startFile, int n) {
 
     // Check traversable tiles
     if(startRank > 0 && piece_equal(board_clone[startRank - 1][startFile], &NULL_PIECE)) initial_spread(visited, startRank - 1, startFile, n);
-    if(startRank < BOARD_SIZE - 1 && piece_equal(board_clone[startRank + 1][startFile], &NULL_PIECE)) initial_spread(visited, startRank + 1, startFile. n);
+    if(startRank < BOARD_SIZE - 1 && piece_equal(board_clone[startRank + 1][startFile], &NULL_PIECE)) initial_spread(visited, startRank + 1, startFile, n);
     if(startFile > 0 && piece_equal(board_clone[startRank][startFile - 1], &NULL_PIECE)) initial_spread(visited, startRank, startFile - 1, n);
     if(startFile < BOARD_SIZE - 1 && piece_equal(board_clone[startRank][startFile + 1], &NULL_PIECE)) initial_spread(visited, startRank, startFile + 1, n);
 }
@@ -760,169 +2112,730 @@ int find_path_back(bool *path, int *initial_reach, int *paths, int startRank, in
 // Returns the length of the path, excluding the starting piece
 int min_disruption(bool *path, int *paths, int startRank, int startFile, int endRank, int endFile) {
     int initial_reach [BOARD_SIZE][BOARD_SIZE] = {0};
-    initial_spread(initial_reach, startRank, startFile);
-    further_spread(initial_reach, 2, startRank, startFile);
+    initial_spread((int *) initial_reach, startRank, startFile, 1);
+    further_spread((int *) initial_reach, 2, startRank, startFile);
     initial_reach[startRank][startFile] = 1;
 
-    return find_path_back(path, initial_reach, paths, endRank, endFile, startRank, startFile); // Go backwards
+    return find_path_back(path, (int *) initial_reach, paths, endRank, endFile, startRank, startFile); // Go backwards
 }
 
-// Calculate closest exits
-void closest_exit(int *pathExitsOrdered, int *closestExits, int length) {
-    for(int i = 1; i < length; i++) closestExits[i] = -1;
-    for(int i = 1; i < length; i++) if(pathExitsOrdered[i] != 0) closestExits[i] = i; // The closest exit is the current tile
-    while(true) {
-        bool flag = true; // Whether we can terminate
-        for(int i = 1; i < length; i++) {
-            if(closestExits[i] == -1) { // No exit found yet
-                flag = false;
-                if(i > 1 && closestExits[i - 1] != -1) closestExits[i] = closestExits[i - 1];
-                else if(i < length - 1 && closestExits[i + 1] != -1) closestExits[i] = closestExits[i + 1];
+// Rough timings of the physical hardware, used to compare candidate motion plans
+// Defaults are the old fixed step loop (222 steps per tile at 0.1ms unloaded, 1.5ms loaded) until the controller passes in
+// the speeds measured for its rig (see calibrate.py)
+float unloadedSecondsPerTile = 0.0222f;
+float loadedSecondsPerTile = 0.333f;
+void set_tile_seconds(float unloaded, float loaded) {
+    if(unloaded != unloadedSecondsPerTile || loaded != loadedSecondsPerTile) clear_plan_cache(); // Cheapest plans may change
+    unloadedSecondsPerTile = unloaded;
+    loadedSecondsPerTile = loaded;
+}
+
+// Typical wait per magnet toggle; 2s until the controller passes in the settle times measured for its rig (see motion.py)
+float magnetToggleSeconds = 2.0f;
+void set_magnet_toggle_seconds(float seconds) {
+    if(seconds != magnetToggleSeconds) clear_plan_cache(); // Cheapest plans may change
+    magnetToggleSeconds = seconds;
+}
+
+// Drag risk taken on by the plan being built (see DRAG_RISK_SECONDS for how it is weighed against time)
+float planRisk = 0;
+
+// Estimated execution time of the commands queued from position "firstCommand" onwards
+// Both axes step together, so a two-axis move takes as long as its longer axis
+float plan_cost(int firstCommand) {
+    float seconds = 0;
+    bool magnetOn = false; // Plans always start and end with the magnet off
+    for(int i = firstCommand; i < numCommandsInQueue; i++) {
+        struct next_command *command = &commandQueue[i];
+        if(command->commandType == MAGNET_TOGGLE) {
+            magnetOn = command->i1 == 1;
+            seconds += magnetToggleSeconds;
+            continue;
+        }
+
+        float distance = fabsf(command->f2);
+        if((command->commandType == BOTH_MOTOR_AXES || command->commandType == PARK) && fabsf(command->f1) > distance) distance = fabsf(command->f1);
+        seconds += distance * (magnetOn ? loadedSecondsPerTile : unloadedSecondsPerTile);
+    }
+    return seconds;
+}
+
+// Everything a dry run of the planner can change, so that candidate plans can be tried and then discarded
+// The real board is included because captured pieces nudged along the perimeter are recorded where they end up
+struct plan_checkpoint {
+    int numCommands;
+    float motorRow;
+    float motorCol;
+    float planRisk;
+    struct piece *boardClone [BOARD_SIZE][BOARD_SIZE];
+    struct piece *board [BOARD_SIZE][BOARD_SIZE];
+};
+
+void save_plan_checkpoint(struct plan_checkpoint *checkpoint) {
+    checkpoint->numCommands = numCommandsInQueue;
+    checkpoint->motorRow = motorRow;
+    checkpoint->motorCol = motorCol;
+    checkpoint->planRisk = planRisk;
+    memcpy(checkpoint->boardClone, board_clone, sizeof(board_clone));
+    memcpy(checkpoint->board, board, sizeof(board));
+}
+
+void restore_plan_checkpoint(struct plan_checkpoint *checkpoint) {
+    numCommandsInQueue = checkpoint->numCommands;
+    motorRow = checkpoint->motorRow;
+    motorCol = checkpoint->motorCol;
+    planRisk = checkpoint->planRisk;
+    memcpy(board_clone, checkpoint->boardClone, sizeof(board_clone));
+    memcpy(board, checkpoint->board, sizeof(board));
+    planStatus = PLAN_OK;
+}
+
+// Tiles are encoded as row * BOARD_SIZE + col throughout the planner
+bool is_perimeter_tile(int tile) {
+    int row = tile / BOARD_SIZE, col = tile % BOARD_SIZE;
+    return row < BOARD_START || col < BOARD_START || row >= BOARD_START + 8 || col >= BOARD_START + 8;
+}
+
+// Breadth-first search from one tile through empty tiles of the board clone (the starting tile itself may be occupied)
+// The route ends at targetTile or, if targetTile is -1, at the nearest empty tile not marked in "avoid"
+// Writes the route into "route" (start first) and returns the number of steps on it, or -1 if the target can't be reached.
+int shortest_route(int *route, int startTile, int targetTile, bool *avoid) {
+    int ref [BOARD_SIZE * BOARD_SIZE]; // Points to the tile from which the route came
+    for(int i = 0; i < BOARD_SIZE * BOARD_SIZE; i++) ref[i] = -1;
+
+    int queue [BOARD_SIZE * BOARD_SIZE];
+    int queueStart = 0, queueEnd = 0;
+    queue[queueEnd++] = startTile;
+    ref[startTile] = startTile;
+
+    int found = -1;
+    while(queueStart < queueEnd && found == -1) {
+        int tile = queue[queueStart++];
+        int row = tile / BOARD_SIZE, col = tile % BOARD_SIZE;
+        int nextRows [4] = {row - 1, row + 1, row, row};
+        int nextCols [4] = {col, col, col - 1, col + 1};
+        for(int k = 0; k < 4; k++) {
+            if(nextRows[k] < 0 || nextRows[k] >= BOARD_SIZE || nextCols[k] < 0 || nextCols[k] >= BOARD_SIZE) continue; // Off the board
+            int next = nextRows[k] * BOARD_SIZE + nextCols[k];
+            if(ref[next] != -1 || !piece_equal(board_clone[nextRows[k]][nextCols[k]], &NULL_PIECE)) continue; // Seen, or blocked
+
+            ref[next] = tile;
+            queue[queueEnd++] = next;
+            if(targetTile == -1 ? !avoid[next] : next == targetTile) {
+                found = next;
+                break;
             }
         }
-        if(flag) break;
     }
+    if(found == -1) return -1;
+
+    int length = 0;
+    for(int tile = found; tile != startTile; tile = ref[tile]) length++;
+    for(int tile = found, i = length; i >= 0; tile = ref[tile], i--) route[i] = tile;
+    return length;
+}
+
+// Moves the carriage to the first tile of the route, then drags the piece there along the route
+// Consecutive steps in the same direction are merged into a single motor command
+void drive_route(int *route, int length) {
+    motor_move_both(route[0] / BOARD_SIZE - motorRow, route[0] % BOARD_SIZE - motorCol, false);
+    toggle_magnet(true);
+
+    int segmentStart = 0;
+    for(int i = 1; i <= length; i++) {
+        bool turning = i < length && (route[i + 1] - route[i] != route[i] - route[i - 1]);
+        if(i == length || turning) {
+            motor_move_both(route[i] / BOARD_SIZE - route[segmentStart] / BOARD_SIZE, route[i] % BOARD_SIZE - route[segmentStart] % BOARD_SIZE, true);
+            segmentStart = i;
+        }
+    }
+    toggle_magnet(false);
+
+    board_clone[route[length] / BOARD_SIZE][route[length] % BOARD_SIZE] = board_clone[route[0] / BOARD_SIZE][route[0] % BOARD_SIZE];
+    board_clone[route[0] / BOARD_SIZE][route[0] % BOARD_SIZE] = &NULL_PIECE;
 }
 
+// A piece that has been moved aside and may need to be put back
+struct displaced_piece {
+    int fromTile;
+    int toTile;
+};
+
 // Used to move pieces in cramped areas. The general strategy is:
-// Remove obstacles along the path until there are none left, then move the main piece, then put everything back
-
-// paths: An ordered array of path coordinates, from start to end
-// closestExit: The closest exit to each square on the path, in the order of paths
-// srcRank...destFile: For the final target piece movement
-// exitDist: Distance currently being evacuated, items closest to exit go first (to ensure no collision)
-void clear_path(bool *path, int *paths, int *pathExitsOrdered, int *closestExit, int length, int srcRank, int srcFile, int destRank, int destFile, int exitDist) {
-    closest_exit(pathExitsOrdered, closestExit, length);
-
-    bool pieceNeedsMove = false;
-    for(int i = 1; i < length; i++) {
-        if(!piece_equal(board_clone[paths[i] / BOARD_SIZE][paths[i] % BOARD_SIZE], &NULL_PIECE)) {
-            pieceNeedsMove = true;
-            if(abs(closestExit[i] - i) == exitDist) { // Exit this item
-                // Run direct motor command to move along path tiles one by one until exit is reached
-                // Use motor to exit to any valid exit
-                // Move motor to the piece's starting position, turn on magnet
-                motor_move_both(paths[i] / BOARD_SIZE - motorRow, paths[i] % BOARD_SIZE - motorCol, false);
-                toggle_magnet(true);
-
-                int curPathPos = i;
-                while(curPathPos != closestExit[i]) { // Move to the exit slot
-                    int nextPathPos = (curPathPos > closestExit ? curPathPos-- : curPathPos++);
-                    motor_move_both((paths[nextPathPos] / BOARD_SIZE) - (paths[curPathPos] / BOARD_SIZE), (paths[nextPathPos] % BOARD_SIZE) - (paths[curPathPos] % BOARD_SIZE), true); // Move to next path tile
-                }
+// Remove obstacles along the path until there are none left, then move the main piece, then put everything back.
+//
+// Obstacles are evacuated one at a time, always picking whichever has the shortest route to a free tile off the path
+// (which frees up the path for the ones behind it). Displaced pieces are pushed onto a stack and restored at the end,
+// each along its own shortest route back. Captured pieces pushed from one perimeter tile to another are left where they are.
+// paths: An ordered array of path coordinates, from the source (paths[0]) to the destination (paths[length])
+// Returns false if an obstacle has no exit or a displaced piece can't get back; planStatus says which.
+bool clear_path(int *paths, int length) {
+    bool onPath [BOARD_SIZE * BOARD_SIZE] = {0}; // Obstacles may travel along the path, but can't be parked on it
+    for(int i = 0; i <= length; i++) onPath[paths[i]] = true;
+
+    struct displaced_piece displaced [BOARD_SIZE * BOARD_SIZE];
+    int numDisplaced = 0;
+    int route [BOARD_SIZE * BOARD_SIZE];
 
-                int exitRow = -1, exitCol = -1;
-                int nextRows [4] = {(paths[curPathPos] / BOARD_SIZE) - 1, (paths[curPathPos] / BOARD_SIZE) + 1, (paths[curPathPos] / BOARD_SIZE), (paths[curPathPos] / BOARD_SIZE)};
-                int nextCols [4] = {(paths[curPathPos] % BOARD_SIZE), (paths[curPathPos] % BOARD_SIZE), (paths[curPathPos] % BOARD_SIZE) - 1, (paths[curPathPos] % BOARD_SIZE) + 1};
-                for(int k = 0; k < 4; k++) {
-                    if(nextRows[k] < 0 || nextRows[k] >= BOARD_SIZE || nextCols[k] < 0 || nextCols[k] >= BOARD_SIZE) continue; // Off the board
-                    if(path[nextRows[k] * BOARD_SIZE + nextCols[k]]) continue; // Still on the path, isn't an exit;
-                    if(piece_equal(board_clone[nextRows[k]][nextCols[k]], &NULL_PIECE)) { // Exit found
-                        exitRow = nextRows[k];
-                        exitCol = nextCols[k];
-                        break;
-                    }
-                }
-                if(exitRow == -1 || exitCol == -1) {
-                    // Unhandled error, needs further implementation
-                    printf("WARNING HELP HELP WHAT IS GOING ON?\n");
-                }
+    while(true) {
+        int bestTile = -1, bestLength = -1;
+        bool blocked = false;
+        for(int i = 1; i <= length; i++) {
+            if(piece_equal(board_clone[paths[i] / BOARD_SIZE][paths[i] % BOARD_SIZE], &NULL_PIECE)) continue;
+            blocked = true;
+            int exitLength = shortest_route(route, paths[i], -1, onPath);
+            if(exitLength != -1 && (bestLength == -1 || exitLength < bestLength)) {
+                bestTile = paths[i];
+                bestLength = exitLength;
+            }
+        }
+        if(!blocked) break; // Path is clear
+        if(bestTile == -1) {
+            if(debugLogging) printf("[PLANNER] No exit for pieces blocking the path from (%d, %d) to (%d, %d)\n", paths[0] / BOARD_SIZE, paths[0] % BOARD_SIZE,
+                paths[length] / BOARD_SIZE, paths[length] % BOARD_SIZE);
+            planStatus = PLAN_NO_EXIT;
+            return false;
+        }
+
+        shortest_route(route, bestTile, -1, onPath);
+        drive_route(route, bestLength);
+        struct displaced_piece moved = {bestTile, route[bestLength]};
+        displaced[numDisplaced++] = moved;
+    }
+
+    // Base case; move the target piece along the path, tile by tile
+    drive_route(paths, length);
+
+    // Put displaced pieces back, most recent first. A piece whose way back is still blocked by another displaced piece waits its turn.
+    while(numDisplaced > 0) {
+        bool progress = false;
+        for(int i = numDisplaced - 1; i >= 0; i--) {
+            struct displaced_piece *piece = &displaced[i];
+            if(is_perimeter_tile(piece->fromTile) && is_perimeter_tile(piece->toTile)) {
+                // A captured piece; its exact spot doesn't matter, so record where it ended up instead
+                board[piece->toTile / BOARD_SIZE][piece->toTile % BOARD_SIZE] = board[piece->fromTile / BOARD_SIZE][piece->fromTile % BOARD_SIZE];
+                board[piece->fromTile / BOARD_SIZE][piece->fromTile % BOARD_SIZE] = &NULL_PIECE;
+                planParked[numPlanParked][0] = piece->fromTile;
+                planParked[numPlanParked++][1] = piece->toTile;
+            } else {
+                int backLength = shortest_route(route, piece->toTile, piece->fromTile, NULL);
+                if(backLength == -1) continue;
+                drive_route(route, backLength);
+            }
 
-                motor_move_both(exitRow - (paths[curPathPos] / BOARD_SIZE), exitCol - (paths[curPathPos] % BOARD_SIZE), true); // Move the item onto the exit tile
-                toggle_magnet(false); // Turn off magnet
-                pathExitsOrdered[curPathPos]--; // One less path here!
+            displaced[i] = displaced[--numDisplaced];
+            progress = true;
+        }
+        if(!progress) {
+            if(debugLogging) printf("[PLANNER] %d displaced piece(s) can't find their way back\n", numDisplaced);
+            planStatus = PLAN_NO_ROUTE;
+            return false;
+        }
+    }
+    return planStatus == PLAN_OK;
+}
 
-                board_clone[exitRow][exitCol] = board_clone[paths[i] / BOARD_SIZE][paths[i] % BOARD_SIZE]; // Change board clone to match
-                board_clone[paths[i] / BOARD_SIZE][paths[i] % BOARD_SIZE] = &NULL_PIECE;
-                closest_exit(pathExitsOrdered, closestExit, length); // Recalculate closest exits
+// Routing between tile centres forces every occupied tile on the way to be evacuated first.
+// The corridor planner works on a lattice at half-tile resolution instead: tile centres, the midpoints of tile edges, and tile corners.
+// A piece can then slide along the lane between two occupied tiles, at the price of some risk of dragging its neighbours along.
+// Lattice node (a, b) sits at (a / 2, b / 2) in tile coordinates, and is encoded as a * LATTICE_SIZE + b.
+#define LATTICE_SIZE (2 * BOARD_SIZE - 1)
+#define LATTICE_NODES (LATTICE_SIZE * LATTICE_SIZE)
+
+// Drag risk of passing a stationary piece, depending on how close the lane runs to its centre
+// These depend on piece size and magnet strength, and should be tuned per board
+const float EDGE_DRAG_RISK = 1.0f; // Along the edge of an occupied tile (0.5 tiles from its centre)
+const float CORNER_DRAG_RISK = 0.4f; // Past the corner of an occupied tile (0.71 tiles from its centre)
+const float MAX_DRAG_RISK = 2.0f; // Most risk tolerated at any single point, e.g. squeezing between two occupied tiles
+const float DRAG_RISK_SECONDS = 0.5f; // Time penalty per unit of risk, so that a riskier route has to save real time to be chosen
+
+// Total drag risk for a piece sitting on the given lattice node, or -1 if the node is blocked outright
+// The moving piece's own source tile doesn't count, since it has just left it
+float drag_risk(int node, int srcTile) {
+    int a = node / LATTICE_SIZE, b = node % LATTICE_SIZE;
+    float perTile = (a % 2 == 1 && b % 2 == 1) ? CORNER_DRAG_RISK : EDGE_DRAG_RISK;
+    float risk = 0;
+
+    // The (up to four) tiles touching this point
+    for(int row = a / 2; row <= (a + 1) / 2; row++) {
+        for(int col = b / 2; col <= (b + 1) / 2; col++) {
+            if(row * BOARD_SIZE + col == srcTile || piece_equal(board_clone[row][col], &NULL_PIECE)) continue;
+            if(a % 2 == 0 && b % 2 == 0) return -1; // Occupied tile centre
+            risk += perTile;
+        }
+    }
+    return risk > MAX_DRAG_RISK ? -1 : risk;
+}
 
-                // Perform recursive call, then move the piece back into original place
-                clear_path(path, paths, pathExitsOrdered, closestExit, length, srcRank, srcFile, destRank, destFile, exitDist);
+// Dijkstra's over the corridor lattice, costed by loaded travel time plus drag risk
+// Writes the route (as lattice nodes, source first) into "route", its total drag risk into "risk",
+// and returns its length in steps, or -1 if there is none
+int corridor_route(int *route, int srcTile, int destTile, float *risk) {
+    float dist [LATTICE_NODES];
+    int ref [LATTICE_NODES]; // Points to the node from which the route came
+    bool done [LATTICE_NODES];
+    for(int i = 0; i < LATTICE_NODES; i++) {
+        dist[i] = -1;
+        ref[i] = -1;
+        done[i] = false;
+    }
 
-                // Use motor to move the piece back
-                motor_move_both(exitRow - motorRow, exitCol - motorCol, false);
-                toggle_magnet(true);
-                motor_move_both((paths[curPathPos] / BOARD_SIZE) - exitRow, (paths[curPathPos] % BOARD_SIZE) - exitCol, true); // Move the piece back onto the path
-                while(curPathPos != i) { // Move from exit slot back to original slot
-                    int nextPathPos = (curPathPos > i ? curPathPos-- : curPathPos++);
-                    motor_move_both((paths[nextPathPos] / BOARD_SIZE) - (paths[curPathPos] / BOARD_SIZE), (paths[nextPathPos] % BOARD_SIZE) - (paths[curPathPos] % BOARD_SIZE), true); // Move to next path tile
-                }
-                toggle_magnet(false);
-                board_clone[paths[i] / BOARD_SIZE][paths[i] % BOARD_SIZE] = board_clone[exitRow][exitCol]; // Change board clone to match
-                board_clone[exitRow][exitCol] = &NULL_PIECE;
-                return; // Piece has been moved back, so we can return
+    int startNode = (srcTile / BOARD_SIZE) * 2 * LATTICE_SIZE + (srcTile % BOARD_SIZE) * 2;
+    int endNode = (destTile / BOARD_SIZE) * 2 * LATTICE_SIZE + (destTile % BOARD_SIZE) * 2;
+
+    // Binary heap of (cost, node); nodes may appear more than once, stale entries are skipped when popped
+    float heapCost [LATTICE_NODES * 8];
+    int heapNode [LATTICE_NODES * 8];
+    int heapLen = 0;
+    dist[startNode] = 0;
+    heapCost[0] = 0;
+    heapNode[heapLen++] = startNode;
+
+    while(heapLen > 0) {
+        int node = heapNode[0];
+        float cost = heapCost[0];
+
+        // Pop the cheapest entry
+        heapLen--;
+        int i = 0;
+        while(true) {
+            int child = 2 * i + 1;
+            if(child >= heapLen) break;
+            if(child + 1 < heapLen && heapCost[child + 1] < heapCost[child]) child++;
+            if(heapCost[child] >= heapCost[heapLen]) break;
+            heapCost[i] = heapCost[child];
+            heapNode[i] = heapNode[child];
+            i = child;
+        }
+        heapCost[i] = heapCost[heapLen];
+        heapNode[i] = heapNode[heapLen];
+
+        if(done[node] || cost > dist[node]) continue;
+        done[node] = true;
+        if(node == endNode) break;
+
+        int a = node / LATTICE_SIZE, b = node % LATTICE_SIZE;
+        for(int da = -1; da <= 1; da++) for(int db = -1; db <= 1; db++) {
+            if((da == 0 && db == 0) || a + da < 0 || a + da >= LATTICE_SIZE || b + db < 0 || b + db >= LATTICE_SIZE) continue;
+            int next = (a + da) * LATTICE_SIZE + b + db;
+            if(done[next]) continue;
+
+            float risk = drag_risk(next, srcTile);
+            if(risk < 0) continue;
+            float nextCost = cost + (da != 0 && db != 0 ? 0.7071f : 0.5f) * loadedSecondsPerTile + risk * DRAG_RISK_SECONDS;
+            if(dist[next] >= 0 && nextCost >= dist[next]) continue;
+
+            dist[next] = nextCost;
+            ref[next] = node;
+            if(heapLen >= LATTICE_NODES * 8) continue; // Can't happen: every node is pushed at most once per neighbour
+            int j = heapLen++;
+            while(j > 0 && heapCost[(j - 1) / 2] > nextCost) {
+                heapCost[j] = heapCost[(j - 1) / 2];
+                heapNode[j] = heapNode[(j - 1) / 2];
+                j = (j - 1) / 2;
             }
+            heapCost[j] = nextCost;
+            heapNode[j] = next;
         }
     }
+    if(!done[endNode]) return -1;
 
-    // Check if the list is empty, if so run base case (move the actual target piece)
-    // If the list is not empty, increment exitDist and run the function again
-    if(pieceNeedsMove) {
-        // No pieces are able to be moved with given nearest exit length, so we will accumulate it by 1
-        clear_path(path, paths, pathExitsOrdered, closestExit, length, srcRank, srcFile, destRank, destFile, exitDist + 1);
-        return;
-    } else {
-        // Base case; set up motor to move piece
-        motor_move_both(srcRank - motorRow, srcFile - motorCol, false);
-        toggle_magnet(true);
+    int length = 0;
+    *risk = 0;
+    for(int node = endNode; node != startNode; node = ref[node]) {
+        length++;
+        *risk += drag_risk(node, srcTile);
+    }
+    for(int node = endNode, i = length; i >= 0; node = ref[node], i--) route[i] = node;
+    return length;
+}
 
-        for(int curPathPos = 0; curPathPos < length; curPathPos++) {
-            int nextPathPos = curPathPos + 1;
-            motor_move_both((paths[nextPathPos] / BOARD_SIZE) - (paths[curPathPos] / BOARD_SIZE), (paths[nextPathPos] % BOARD_SIZE) - (paths[curPathPos] % BOARD_SIZE), true); // move to next path tile
+// Like drive_route(), but along lattice nodes, so motor commands may move by half tiles
+void drive_corridor(int *route, int length) {
+    motor_move_both(route[0] / LATTICE_SIZE / 2.0f - motorRow, route[0] % LATTICE_SIZE / 2.0f - motorCol, false);
+    toggle_magnet(true);
+
+    int segmentStart = 0;
+    for(int i = 1; i <= length; i++) {
+        bool turning = i < length && (route[i + 1] - route[i] != route[i] - route[i - 1]);
+        if(i == length || turning) {
+            motor_move_both((route[i] / LATTICE_SIZE - route[segmentStart] / LATTICE_SIZE) / 2.0f,
+                (route[i] % LATTICE_SIZE - route[segmentStart] % LATTICE_SIZE) / 2.0f, true);
+            segmentStart = i;
         }
+    }
+    toggle_magnet(false);
+}
 
-        toggle_magnet(false); // WE'RE DONE!
-        return;
+// Drag risk of passing a stationary piece at the given distance from its centre (in tiles), or -1 if the pieces would collide
+// Matches the risks used on the corridor lattice (edges are 0.5 tiles from a centre, corners 0.71)
+float proximity_risk(float distance) {
+    if(distance < 0.499f) return -1;
+    if(distance < 0.501f) return EDGE_DRAG_RISK;
+    if(distance < 0.75f) return CORNER_DRAG_RISK;
+    return 0;
+}
+
+// Total drag risk of sliding a piece in a straight line from src to dest, or -1 if it would run into another piece
+float direct_risk(int srcRank, int srcFile, int destRank, int destFile) {
+    float deltaRow = destRank - srcRank, deltaCol = destFile - srcFile;
+    float lengthSquared = deltaRow * deltaRow + deltaCol * deltaCol;
+    float risk = 0;
+
+    for(int row = 0; row < BOARD_SIZE; row++) for(int col = 0; col < BOARD_SIZE; col++) {
+        if((row == srcRank && col == srcFile) || piece_equal(board_clone[row][col], &NULL_PIECE)) continue;
+
+        // Closest approach between the line and this piece's centre
+        float t = lengthSquared == 0 ? 0 : ((row - srcRank) * deltaRow + (col - srcFile) * deltaCol) / lengthSquared;
+        t = t < 0 ? 0 : (t > 1 ? 1 : t);
+        float offRow = srcRank + t * deltaRow - row, offCol = srcFile + t * deltaCol - col;
+
+        float pieceRisk = proximity_risk(sqrtf(offRow * offRow + offCol * offCol));
+        if(pieceRisk < 0) return -1;
+        risk += pieceRisk;
     }
+    return risk;
 }
 
-// Motor will move a piece from the given src to the given dest
-// direct: whether to go there in a straight line, or move obstructing pieces first
-//
-// Note that moving pieces between tiles does not work given our hardware constraints.
-// The magnet is powerful enough that it will start dragging along other adjacent pieces.
-void motor_instruct(int srcRank, int srcFile, int destRank, int destFile, bool direct) {
-    if(direct) {
+// Ways of physically moving a piece, see motor_instruct()
+const int MOVE_DIRECT = 0;
+const int MOVE_CORRIDOR = 1;
+const int MOVE_EVACUATE = 2;
+
+// Queues one way of moving a piece from src to dest, and updates the board clone
+// Returns false if that way isn't possible on the current physical layout
+bool motor_instruct_with(int method, int srcRank, int srcFile, int destRank, int destFile) {
+    numPlanParked = 0;
+    if(method == MOVE_DIRECT) {
+        float risk = direct_risk(srcRank, srcFile, destRank, destFile);
+        if(risk < 0) return false;
+
         motor_move_both(srcRank - motorRow, srcFile - motorCol, false); // Move to source position
         toggle_magnet(true); // Turn on electromagnet
         motor_move_both(destRank - srcRank, destFile - srcFile, true); // Move at once, as the crow flies
         toggle_magnet(false); // Turn magnet off
-    } else { // Move along lines
+        planRisk += risk;
+    } else if(method == MOVE_CORRIDOR) { // Slide through the gaps between pieces
+        int corridor [LATTICE_NODES];
+        float risk;
+        int corridorLength = corridor_route(corridor, srcRank * BOARD_SIZE + srcFile, destRank * BOARD_SIZE + destFile, &risk);
+        if(corridorLength == -1) return false;
+
+        drive_corridor(corridor, corridorLength);
+        planRisk += risk;
+    } else { // Move along lines, moving obstructing pieces out of the way
         bool path [BOARD_SIZE][BOARD_SIZE] = {0}; // All set to false, set tiles to true when they're on the path
-        int paths [64] = {0}; // Ordered list of paths
+        int paths [BOARD_SIZE * BOARD_SIZE] = {0}; // Ordered list of paths
+
+        int length = min_disruption((bool *) path, paths, srcRank, srcFile, destRank, destFile); // Does min dist calculations, dijkstra's, and draws the final path onto the path array
+        return clear_path(paths, length); // Also updates the board clone
+    }
+
+    // The piece is now physically at its destination
+    board_clone[destRank][destFile] = board_clone[srcRank][srcFile];
+    board_clone[srcRank][srcFile] = &NULL_PIECE;
+    return planStatus == PLAN_OK;
+}
+
+// Searches for the cheapest way to move a piece from the given src to the given dest and queues it (see motor_instruct())
+bool plan_motor_instruct(int srcRank, int srcFile, int destRank, int destFile) {
+    struct plan_checkpoint checkpoint;
+    save_plan_checkpoint(&checkpoint);
+    bool logging = debugLogging;
+    debugLogging = false; // Only the chosen plan is logged
+
+    int bestMethod = -1;
+    float bestCost = 0;
+    int failure = PLAN_NO_EXIT;
+    for(int method = MOVE_DIRECT; method <= MOVE_EVACUATE; method++) {
+        bool feasible = motor_instruct_with(method, srcRank, srcFile, destRank, destFile);
+        float cost = plan_cost(checkpoint.numCommands) + (planRisk - checkpoint.planRisk) * DRAG_RISK_SECONDS;
+        if(!feasible && planStatus != PLAN_OK) failure = planStatus;
+        restore_plan_checkpoint(&checkpoint);
+
+        if(feasible && (bestMethod == -1 || cost < bestCost)) {
+            bestMethod = method;
+            bestCost = cost;
+        }
+    }
+
+    debugLogging = logging;
+    if(bestMethod == -1) {
+        planStatus = failure;
+        return false;
+    }
+    return motor_instruct_with(bestMethod, srcRank, srcFile, destRank, destFile);
+}
+
+void make_plan_key(struct plan_key *key, uint64_t *hash, int srcRank, int srcFile, int destRank, int destFile) {
+    memset(key, 0, sizeof(*key));
+    for(int tile = 0; tile < BOARD_SIZE * BOARD_SIZE; tile++) {
+        if(!piece_equal(board_clone[tile / BOARD_SIZE][tile % BOARD_SIZE], &NULL_PIECE)) key->occupancy[tile / 64] |= 1ULL << (tile % 64);
+    }
+    key->srcTile = srcRank * BOARD_SIZE + srcFile;
+    key->destTile = destRank * BOARD_SIZE + destFile;
+    key->motorRow = motorRow;
+    key->motorCol = motorCol;
+
+    *hash = 14695981039346656037ULL; // FNV-1a
+    for(size_t i = 0; i < sizeof(*key); i++) *hash = (*hash ^ ((unsigned char *) key)[i]) * 1099511628211ULL;
+}
+
+struct cached_plan *find_cached_plan(struct plan_key *key, uint64_t hash) {
+    for(int i = 0; i < PLAN_CACHE_SIZE; i++) {
+        if(planCache[i].used && planCache[i].hash == hash && !memcmp(&planCache[i].key, key, sizeof(*key))) return &planCache[i];
+    }
+    return NULL;
+}
 
-        int length = min_disruption(path, paths, srcRank, srcFile, destRank, destFile); // Does min dist calculations, dijkstra's, and draws the final path onto the path array
+// Fills a cache entry from the plan just made, which queued everything from firstCommand on
+// Returns false if the plan is too long to remember
+bool record_plan(struct cached_plan *entry, bool feasible, int firstCommand, float riskBefore) {
+    int numCommands = numCommandsInQueue - firstCommand;
+    if(numCommands > PLAN_CACHE_COMMANDS || numPlanParked > PLAN_CACHE_PARKED || (!feasible && numCommands != 0)) return false;
+    // A nearly full queue can rule out plans that would otherwise win, and running out of room says nothing about the layout
+    if(firstCommand > COMMAND_QUEUE_SIZE / 2 || (!feasible && planStatus == PLAN_QUEUE_FULL)) return false;
+
+    entry->feasible = feasible;
+    entry->status = planStatus;
+    entry->numCommands = numCommands;
+    memcpy(entry->commands, &commandQueue[firstCommand], numCommands * sizeof(struct next_command));
+    entry->motorRow = motorRow;
+    entry->motorCol = motorCol;
+    entry->risk = planRisk - riskBefore;
+    entry->numParked = numPlanParked;
+    memcpy(entry->parked, planParked, numPlanParked * sizeof(planParked[0]));
+    return true;
+}
+
+bool same_plan(struct cached_plan *a, struct cached_plan *b) {
+    if(a->feasible != b->feasible || a->status != b->status || a->numCommands != b->numCommands || a->motorRow != b->motorRow || a->motorCol != b->motorCol) return false;
+    if(fabsf(a->risk - b->risk) > 0.001f) return false; // Risk is a difference of running totals
+    for(int i = 0; i < a->numCommands; i++) { // The piece on magnet commands isn't part of the plan (see label_magnet_commands())
+        struct next_command *x = &a->commands[i], *y = &b->commands[i];
+        if(x->commandType != y->commandType || x->i1 != y->i1 || x->f2 != y->f2 || (x->commandType != MAGNET_TOGGLE && x->f1 != y->f1)) return false;
+    }
+    return a->numParked == b->numParked && !memcmp(a->parked, b->parked, a->numParked * sizeof(a->parked[0]));
+}
+
+// Magnet commands carry the piece being carried, which the cache key doesn't cover
+// Works it out again for the queued commands from firstCommand on, following the pieces through the current board clone
+void label_magnet_commands(int firstCommand) {
+    struct piece *layout [BOARD_SIZE][BOARD_SIZE];
+    memcpy(layout, board_clone, sizeof(layout));
+    float row = motorRow, col = motorCol;
+    int pickupRow = -1, pickupCol = -1, pieceId = -1;
+
+    for(int i = firstCommand; i < numCommandsInQueue; i++) {
+        struct next_command *command = &commandQueue[i];
+        if(command->commandType == X_MOTOR_AXIS) row += command->f2;
+        else if(command->commandType == Y_MOTOR_AXIS) col += command->f2;
+        else if(command->commandType == BOTH_MOTOR_AXES || command->commandType == PARK) {
+            row += command->f1;
+            col += command->f2;
+        } else if(command->i1 == 1) {
+            pieceId = piece_under_carriage(layout, row, col);
+            pickupRow = (int) roundf(row);
+            pickupCol = (int) roundf(col);
+            command->f1 = pieceId;
+        } else {
+            command->f1 = pieceId;
+            if(pickupRow == -1) continue;
+            struct piece *carried = layout[pickupRow][pickupCol];
+            layout[pickupRow][pickupCol] = &NULL_PIECE;
+            layout[(int) roundf(row)][(int) roundf(col)] = carried;
+            pickupRow = -1;
+        }
+    }
+}
 
-        int pathExits [BOARD_SIZE][BOARD_SIZE] = {0}; // Exits from each tile
+// Queues a remembered plan and applies what it does to the board clone (and to the board, for parked captured pieces)
+bool replay_plan(struct cached_plan *entry) {
+    if(!entry->feasible) {
+        planStatus = entry->status;
+        return false;
+    }
+    if(numCommandsInQueue + entry->numCommands > COMMAND_QUEUE_SIZE) {
+        planStatus = PLAN_QUEUE_FULL;
+        return false;
+    }
+
+    int firstCommand = numCommandsInQueue;
+    for(int i = 0; i < entry->numCommands; i++) commandQueue[numCommandsInQueue++] = entry->commands[i];
+    label_magnet_commands(firstCommand);
+    motorRow = entry->motorRow;
+    motorCol = entry->motorCol;
+    planRisk += entry->risk;
+    for(int i = 0; i < entry->numParked; i++) {
+        int from = entry->parked[i][0], to = entry->parked[i][1];
+        board_clone[to / BOARD_SIZE][to % BOARD_SIZE] = board_clone[from / BOARD_SIZE][from % BOARD_SIZE];
+        board_clone[from / BOARD_SIZE][from % BOARD_SIZE] = &NULL_PIECE;
+        board[to / BOARD_SIZE][to % BOARD_SIZE] = board[from / BOARD_SIZE][from % BOARD_SIZE];
+        board[from / BOARD_SIZE][from % BOARD_SIZE] = &NULL_PIECE;
+    }
+    int src = entry->key.srcTile, dest = entry->key.destTile;
+    board_clone[dest / BOARD_SIZE][dest % BOARD_SIZE] = board_clone[src / BOARD_SIZE][src % BOARD_SIZE];
+    board_clone[src / BOARD_SIZE][src % BOARD_SIZE] = &NULL_PIECE;
+    planStatus = PLAN_OK;
+    return true;
+}
+
+// Motor will move a piece from the given src to the given dest
+// Every way of getting there (as the crow flies, through the gaps between pieces, or moving obstructing pieces first) is tried
+// against the physical layout in the board clone, and the one with the lowest estimated time plus drag risk is queued.
+// Returns false if no physical plan could be found (see planStatus)
+//
+// Note that the magnet is powerful enough that it will start dragging along other adjacent pieces, hence the risk estimates.
+// Plans are remembered by layout (see DECLARATIONS FOR MOTION PLAN CACHING), so a repeated layout is served without searching again.
+bool motor_instruct(int srcRank, int srcFile, int destRank, int destFile) {
+    if(!planCacheEnabled) return plan_motor_instruct(srcRank, srcFile, destRank, destFile);
+
+    struct plan_key key;
+    uint64_t hash;
+    make_plan_key(&key, &hash, srcRank, srcFile, destRank, destFile);
+    struct cached_plan *cached = find_cached_plan(&key, hash);
+    if(cached != NULL) {
+        planCacheHits++;
+        cached->lastUsed = ++planCacheClock;
+        if(!planCacheValidation) return replay_plan(cached);
+    } else planCacheMisses++;
+
+    int firstCommand = numCommandsInQueue;
+    float riskBefore = planRisk;
+    bool feasible = plan_motor_instruct(srcRank, srcFile, destRank, destFile);
+
+    struct cached_plan fresh;
+    if(!record_plan(&fresh, feasible, firstCommand, riskBefore)) return feasible;
+    if(cached != NULL) { // Validating
+        if(!same_plan(cached, &fresh)) {
+            planCacheMismatches++;
+            if(debugLogging) printf("[PLANNER] Cached plan from (%d, %d) to (%d, %d) doesn't match a fresh one\n", srcRank, srcFile, destRank, destFile);
+        }
+    } else {
+        cached = &planCache[0]; // Take an unused entry, or else the least recently used one
+        for(int i = 0; i < PLAN_CACHE_SIZE && cached->used; i++) {
+            if(!planCache[i].used || planCache[i].lastUsed < cached->lastUsed) cached = &planCache[i];
+        }
+    }
+    fresh.used = true;
+    fresh.hash = hash;
+    fresh.key = key;
+    fresh.lastUsed = ++planCacheClock;
+    memcpy(cached, &fresh, sizeof(fresh));
+    return feasible;
+}
+
+// One physical piece relocation belonging to a chess move
+// A chess move needs one to three of these: the moving piece, a captured piece being deposited, and the rook when castling
+struct relocation {
+    int srcRow, srcCol; // Given within intervals [0, 10)
+    int destRow, destCol; // Ignored when deposit is true
+    bool deposit; // A captured piece, which can go to any free perimeter tile on the capturer's side
+    bool depositWhiteSide;
+};
+
+// Lists up to maxSlots empty perimeter tiles on one side of the board, nearest to (row, col) first
+// Slots are encoded as row * BOARD_SIZE + col
+int perimeter_slots(int *slots, int maxSlots, int row, int col, bool white) {
+    int numSlots = 0;
+    for(int distance = 1; distance < BOARD_SIZE && numSlots < maxSlots; distance++) {
         for(int i = 0; i < BOARD_SIZE; i++) for(int j = 0; j < BOARD_SIZE; j++) {
-            if(path[i][j]) { // On the path
-                int nextRows [4] = {i - 1, i + 1, i, i};
-                int nextCols [4] = {j, j, j - 1, j + 1};
-                for(int k = 0; k < 4; k++) {
-                    if(nextRows[k] < 0 || nextRows[k] >= BOARD_SIZE || nextCols[k] < 0 || nextCols[k] >= BOARD_SIZE) continue; // Off the board
-                    if(path[nextRows[k]][nextCols[k]]) continue; // Still on the path, isn't an exit
-                    if(piece_equal(board_clone[nextRows[k]][nextCols[k]], &NULL_PIECE)) {
-                        pathExits[i][j]++;
-                    }
-                }
-            }
+            if(max(abs(i - row), abs(j - col)) != distance || numSlots >= maxSlots) continue;
+            if(i != 0 && j != 0 && i != BOARD_SIZE - 1 && j != BOARD_SIZE - 1) continue; // Not on the perimeter
+            if((i < BOARD_SIZE / 2) != white) continue; // Other side's captures
+            if(piece_equal(board[i][j], &NULL_PIECE) && piece_equal(board_clone[i][j], &NULL_PIECE)) slots[numSlots++] = i * BOARD_SIZE + j;
         }
+    }
+    return numSlots;
+}
 
-        int pathExitsOrdered [BOARD_SIZE * BOARD_SIZE]; // Ignore position 0 because it's the start
-        for(int i = 1; i < length; i++) pathExitsOrdered[i] = pathExits[paths[i] / BOARD_SIZE][paths[i] % BOARD_SIZE];
-        int closestExits [BOARD_SIZE * BOARD_SIZE]; // Ignore position 0 because it's the start
+// Queues the motor commands for the given legs in the given order, updating the physical board clone as pieces move
+// Returns false if a leg's destination is still occupied when its turn comes (e.g. the capturer arriving before the victim has left),
+// or if a leg couldn't be planned at all
+bool run_relocations(struct relocation *legs, int *order, int numLegs, int depositSlot) {
+    for(int i = 0; i < numLegs; i++) {
+        struct relocation *leg = &legs[order[i]];
+        int destRow = leg->deposit ? depositSlot / BOARD_SIZE : leg->destRow;
+        int destCol = leg->deposit ? depositSlot % BOARD_SIZE : leg->destCol;
+        if(!piece_equal(board_clone[destRow][destCol], &NULL_PIECE)) return false;
+
+        if(!motor_instruct(leg->srcRow, leg->srcCol, destRow, destCol)) return false;
+    }
+    return true;
+}
 
-        clear_path(path, paths, pathExitsOrdered, closestExits, length, srcRank, srcFile, destRank, destFile, 0);
+// Rearranges order[] into the next permutation in lexicographic order; returns false once all permutations have been visited
+bool next_order(int *order, int n) {
+    int i = n - 2;
+    while(i >= 0 && order[i] >= order[i + 1]) i--;
+    if(i < 0) return false;
+
+    int j = n - 1;
+    while(order[j] <= order[i]) j--;
+    int swap = order[i]; order[i] = order[j]; order[j] = swap;
+    for(int a = i + 1, b = n - 1; a < b; a++, b--) {
+        swap = order[a]; order[a] = order[b]; order[b] = swap;
     }
+    return true;
 }
 
-// Deposits the captured piece onto the perimeter of the chessboard
-// "pieceRow" and "pieceCol" are given within intervals [0, 10)
-void deposit_captured(int pieceRow, int pieceCol, int colour, struct piece *captured) {
-    int depositSpot = first_empty_spot(colour); // Put the piece on the opposite colour's side
+// Plans every piece relocation of one chess move together, instead of each leg in isolation.
+// Every leg ordering is tried along with the nearest few perimeter slots for a captured piece, and the plan with the
+// lowest plan_cost() is queued; this lets a victim be cleared toward the mover's side, and lets each leg start where the last one ended.
+// The board clone must hold the physical layout before the move; the chosen deposit slot is recorded on the board.
+// Returns false, with nothing queued, if no ordering can be carried out physically (planStatus says why)
+bool plan_relocations(struct relocation *legs, int numLegs, struct piece *captured) {
+    planStatus = PLAN_OK;
+    int slots [4] = {-1};
+    int numSlots = 1;
+    for(int i = 0; i < numLegs; i++) {
+        if(!legs[i].deposit) continue;
+        numSlots = perimeter_slots(slots, 4, legs[i].srcRow, legs[i].srcCol, legs[i].depositWhiteSide);
+        if(numSlots == 0) { // Perimeter is full on this side, fall back to the first free spot anywhere
+            slots[0] = first_empty_spot(legs[i].depositWhiteSide);
+            numSlots = 1;
+        }
+    }
+
+    struct plan_checkpoint checkpoint;
+    save_plan_checkpoint(&checkpoint);
+    bool logging = debugLogging;
+    debugLogging = false; // Only the chosen plan is logged
+
+    int order [3] = {0, 1, 2};
+    int bestOrder [3] = {0, 1, 2};
+    int bestSlot = slots[0];
+    float bestCost = -1;
+    int failure = PLAN_OK; // Why the last infeasible candidate failed
+    do {
+        for(int s = 0; s < numSlots; s++) {
+            bool feasible = run_relocations(legs, order, numLegs, slots[s]);
+            float cost = plan_cost(checkpoint.numCommands) + (planRisk - checkpoint.planRisk) * DRAG_RISK_SECONDS;
+            if(!feasible) failure = planStatus;
+            restore_plan_checkpoint(&checkpoint);
+
+            if(feasible && (bestCost < 0 || cost < bestCost)) {
+                bestCost = cost;
+                bestSlot = slots[s];
+                memcpy(bestOrder, order, sizeof(order));
+            }
+        }
+    } while(next_order(order, numLegs));
+
+    debugLogging = logging;
+    if(bestCost < 0) {
+        planStatus = failure == PLAN_OK ? PLAN_NO_EXIT : failure;
+        return false;
+    }
 
-    board[depositSpot / BOARD_SIZE][depositSpot % BOARD_SIZE] = captured;
-    motor_instruct(pieceRow, pieceCol, depositSpot / BOARD_SIZE, depositSpot % BOARD_SIZE, false); // Call motor instructions to move piece off
+    if(!run_relocations(legs, bestOrder, numLegs, bestSlot)) {
+        int status = planStatus;
+        restore_plan_checkpoint(&checkpoint);
+        planStatus = status;
+        return false;
+    }
+    if(captured != NULL) board[bestSlot / BOARD_SIZE][bestSlot % BOARD_SIZE] = captured;
+    return true;
 }
 
 // Returns true if the move succeeds (if king is left open, will revert)
@@ -954,14 +2867,33 @@ bool move_piece(int srcRow, int srcCol, int destRow, int destCol, int turn) {
         return false;
     }
 
+    // Physical relocations: the moving piece, plus any captured piece going to the perimeter (on the capturer's side)
+    struct relocation legs [2] = {{srcRow, srcCol, destRow, destCol, false, false}};
+    int numLegs = 1;
+    struct piece *captured = NULL;
     if(src->pieceId == PAWN_ID && abs(srcRow - destRow) == 1 && abs(srcCol - destCol) == 1) { // Diagonal pawn move, is it a capture or en passant?
         if(piece_equal(dest, &NULL_PIECE)) { // No piece on the diagonal, therefore en passant
-            deposit_captured(srcRow, destCol, other_colour(turn), adj); // Move the captured pawn into the captured pieces area
+            struct relocation victim = {srcRow, destCol, -1, -1, true, other_colour(turn) == BLACK};
+            legs[numLegs++] = victim;
+            captured = adj;
             printf("en passant\n");
         }
     }
-    if(!piece_equal(dest, &NULL_PIECE)) // Something was in the dest spot, meaning it was captured
-        deposit_captured(destRow, destCol, other_colour(turn), dest);
+    if(!piece_equal(dest, &NULL_PIECE)) { // Something was in the dest spot, meaning it was captured
+        struct relocation victim = {destRow, destCol, -1, -1, true, other_colour(turn) == BLACK};
+        legs[numLegs++] = victim;
+        captured = dest;
+    }
+
+    if(!plan_relocations(legs, numLegs, captured)) { // No way to carry the move out physically, move piece back
+        board[destRow][destCol] = dest;
+        board[srcRow][srcCol] = src;
+        board[srcRow][destCol] = adj;
+        find_kings();
+
+        print_tts_message("I can't find a way to move that piece, please choose another move.");
+        return false;
+    }
 
     if(src->pieceId == PAWN_ID && abs(srcRow - destRow) == 2) // Pawn double advance; check for en passant opportunity
         enPassantFile[turn] = srcCol - BOARD_START;
@@ -969,39 +2901,36 @@ bool move_piece(int srcRow, int srcCol, int destRow, int destCol, int turn) {
 
     if(src->pieceId == PAWN_ID && (destRow == BOARD_START || destRow == BOARD_START + 7)) { // Prompt promotion
         char outputMessage [32] = "Promotion for _____, to ";
-        if(turn == white) strncpy(outputMessage + 14, "white", 5);
+        if(turn == WHITE) strncpy(outputMessage + 14, "white", 5);
         else strncpy(outputMessage + 14, "black", 5);
         switch(promote_letter) {
             case 'q':
                 strcat(outputMessage, "queen");
-                board[destRow][destCol] = (turn == white ? &white_queen_p : &black_queen_p);
+                board[destRow][destCol] = (turn == WHITE ? &WHITE_QUEEN_P : &BLACK_QUEEN_P);
                 break;
             case 'r':
                 strcat(outputMessage, "rook");
-                board[destRow][destCol] = (turn == white ? &white_rook_p : &black_rook_p);
+                board[destRow][destCol] = (turn == WHITE ? &WHITE_ROOK_P : &BLACK_ROOK_P);
                 break;
             case 'b':
                 strcat(outputMessage, "bishop");
-                board[destRow][destCol] = (turn == white ? &white_bishop_p : &black_bishop_p);
+                board[destRow][destCol] = (turn == WHITE ? &WHITE_BISHOP_P : &BLACK_BISHOP_P);
                 break;
             case 'n':
                 strcat(outputMessage, "knight");
-                board[destRow][destCol] = (turn == white ? &white_knight_p : &black_knight_p);
+                board[destRow][destCol] = (turn == WHITE ? &WHITE_KNIGHT_P : &BLACK_KNIGHT_P);
                 break;
         }
         print_tts_message(outputMessage);
     }
 
-    // Motor instructions
-    motor_instruct(srcRow, srcCol, destRow, destCol, board[destRow][destCol]->pieceId != knight); // Only the knight moves indirectly
-
     // Check if castling is still legal
-    kingMoved[white] = kingMoved[white] || !piece_equal(board[BOARD_START][BOARD_START + 4], &white_king);
-    aRookMoved[white] = aRookMoved[white] || !piece_equal(board[BOARD_START][BOARD_START], &white_rook);
-    hRookMoved[white] = hRookMoved[white] || !piece_equal(board[BOARD_START][BOARD_START + 7], &white_rook);
-    kingMoved[black] = kingMoved[black] || !piece_equal(board[BOARD_START + 7][BOARD_START + 4], &black_king);
-    aRookMoved[black] = aRookMoved[black] || !piece_equal(board[BOARD_START + 7][BOARD_START], &black_rook);
-    hRookMoved[black] = hRookMoved[black] || !piece_equal(board[BOARD_START + 7][BOARD_START + 7], &black_rook);
+    kingMoved[WHITE] = kingMoved[WHITE] || !piece_equal(board[BOARD_START][BOARD_START + 4], &WHITE_KING);
+    aRookMoved[WHITE] = aRookMoved[WHITE] || !piece_equal(board[BOARD_START][BOARD_START], &WHITE_ROOK);
+    hRookMoved[WHITE] = hRookMoved[WHITE] || !piece_equal(board[BOARD_START][BOARD_START + 7], &WHITE_ROOK);
+    kingMoved[BLACK] = kingMoved[BLACK] || !piece_equal(board[BOARD_START + 7][BOARD_START + 4], &BLACK_KING);
+    aRookMoved[BLACK] = aRookMoved[BLACK] || !piece_equal(board[BOARD_START + 7][BOARD_START], &BLACK_ROOK);
+    hRookMoved[BLACK] = hRookMoved[BLACK] || !piece_equal(board[BOARD_START + 7][BOARD_START + 7], &BLACK_ROOK);
 
     // Check 50 move rule
     if(src->pieceId == PAWN_ID || !piece_equal(dest, &NULL_PIECE)) movesTillDraw = 100; // Pawn moved or capture happened, reset
@@ -1012,18 +2941,29 @@ bool move_piece(int srcRow, int srcCol, int destRow, int destCol, int turn) {
 
 // ASSUMES that legality check for castling has already been made
 bool move_castle(int colour, bool kingSide) {
-    int targetFile = (colour == white ? 0 : 7);
-    board[BOARD_START + targetFile][BOARD_START + (kingSide ? 7 : 0)] = &NULL_PIECE; // Remove rook
-    board[BOARD_START + targetFile][BOARD_START + (kingSide ? 5 : 3)] = (colour == white ? &white_rook : &black_rook); // Reposition rook
-    clone_board(); // Clone board after rook is moved, which is always a guaranteed straight line with no interruptions
+    int targetFile = (colour == WHITE ? 0 : 7);
+    clone_board(); // Physical layout before either piece moves
 
+    board[BOARD_START + targetFile][BOARD_START + (kingSide ? 7 : 0)] = &NULL_PIECE; // Remove rook
+    board[BOARD_START + targetFile][BOARD_START + (kingSide ? 5 : 3)] = (colour == WHITE ? &WHITE_ROOK : &BLACK_ROOK); // Reposition rook
     board[BOARD_START + targetFile][BOARD_START + 4] = &NULL_PIECE; // Remove king
-    board[BOARD_START + targetFile][BOARD_START + (kingSide ? 6 : 2)] = (colour == white ? &white_king : &black_king); // Reposition king
-
-    // Appropriate motor commands (move rook first)
-    motor_instruct(BOARD_START + targetFile, BOARD_START + (kingSide ? 7 : 0), BOARD_START + targetFile, BOARD_START + (kingSide ? 5 : 3), true);
-    motor_instruct(BOARD_START + targetFile, BOARD_START + 4, BOARD_START + targetFile, BOARD_START + (kingSide ? 6 : 2), false);
-    return true; // Always succeeds because legality is presumed to have already been checked
+    board[BOARD_START + targetFile][BOARD_START + (kingSide ? 6 : 2)] = (colour == WHITE ? &WHITE_KING : &BLACK_KING); // Reposition king
+
+    // Appropriate motor commands; the planner decides whether the rook or the king goes first
+    struct relocation legs [2] = {
+        {BOARD_START + targetFile, BOARD_START + (kingSide ? 7 : 0), BOARD_START + targetFile, BOARD_START + (kingSide ? 5 : 3), false, false},
+        {BOARD_START + targetFile, BOARD_START + 4, BOARD_START + targetFile, BOARD_START + (kingSide ? 6 : 2), false, false}
+    };
+    if(!plan_relocations(legs, 2, NULL)) { // No way to carry the move out physically, undo it
+        board[BOARD_START + targetFile][BOARD_START + (kingSide ? 7 : 0)] = (colour == WHITE ? &WHITE_ROOK : &BLACK_ROOK);
+        board[BOARD_START + targetFile][BOARD_START + (kingSide ? 5 : 3)] = &NULL_PIECE;
+        board[BOARD_START + targetFile][BOARD_START + 4] = (colour == WHITE ? &WHITE_KING : &BLACK_KING);
+        board[BOARD_START + targetFile][BOARD_START + (kingSide ? 6 : 2)] = &NULL_PIECE;
+
+        print_tts_message("I can't find a way to castle, please choose another move.");
+        return false;
+    }
+    return true; // Legality is presumed to have already been checked
 }
 
 // Calls move_piece, except takes string sequence as input
@@ -1049,43 +2989,68 @@ int analyze_board(int colour) {
     return -1;
 }
 
-// Method to be called by the main physical chessboard controller
-void run_chess_algorithm(char* turnInput) {
-        char *parsedInput = malloc(sizeof(char) * 10);
-        understand(parsedInput, turnInput); // Will try to convert input into standardized move notation (for this program, at least)
-
+// Plays a move that has already been converted into standardized notation, by understand() or understand_partial()
+void play_parsed_move(char *parsedInput) {
         printf("[Message] You said: %s\n", parsedInput);
         if(!validate_input(parsedInput)) return;
-        if(!validate_move(parsedInput, turn)) {
-            print_tts_message("Not a legal move!");
+
+        long long traceStart = trace_now();
+        bool validMove = validate_move(parsedInput, turn);
+        trace_record(TRACE_VALIDATE, traceStart, trace_now());
+        if(!validMove) {
+            if(!moveAmbiguous) print_tts_message("Not a legal move!"); // Otherwise the player has just been asked which piece they meant
             return;
         }
 
         // If this code is reached, then the move is, on first glance, "legal" (minus checks and such)
-        if(!move_piece_char(parsedInput, turn)) return;
-        free(parsedInput);
+        cancel_park();
+        traceStart = trace_now();
+        bool moved = move_piece_char(parsedInput, turn);
+        trace_record(TRACE_PLAN, traceStart, trace_now());
+        if(!moved) { // Nothing could carry it out: the board is as it was and the same player is asked for another move
+            park_carriage(); // Same position, same park
+            return;
+        }
 
         // If this code is reached, move completed and uploaded to board
-        switch(analyze_board(turn)) {
+        boardStatus = analyze_board(turn);
+        switch(boardStatus) {
         case 0: // Check
-            print_tts_message("Check!");
+            announce("Check!", TTS_ALERT);
             break;
         case 1: // Checkmate
-            print_tts_message(turn == white ? "Checkmate, white wins!" : "Checkmate, black wins!");
+            announce(turn == WHITE ? "Checkmate, white wins!" : "Checkmate, black wins!", TTS_GAME_OVER);
             isRunning = false;
             break;
         case 2: // Stalemate
-            print_tts_message("Stalemate.");
+            announce("Stalemate.", TTS_GAME_OVER);
             isRunning = false;
             break;
         }
         print_board();
 
         if(movesTillDraw <= 0) { // 50-move rule
-            print_tts_message("50 move rule. Game is tied.");
+            announce("50 move rule. Game is tied.", TTS_GAME_OVER);
             isRunning = false;
         }
 
-        turn = (turn == white ? black : white);
+        turn = (turn == WHITE ? BLACK : WHITE);
         promote_letter = 'q'; // Reset to promoting to queen
+        if(isRunning) announce_tablebase_result();
+        archive_record_move(parsedInput);
+        park_carriage();
+        announce(turn == WHITE ? "It's white's turn" : "It's black's turn", TTS_INFO); // Dropped if the game just ended
+        publish_snapshot();
+}
+
+// Method to be called by the main physical chessboard controller
+void run_chess_algorithm(char* turnInput) {
+        traceTurn++;
+        long long traceStart = trace_now();
+        char *parsedInput = malloc(sizeof(char) * 10);
+        understand(parsedInput, turnInput); // Will try to convert input into standardized move notation (for this program, at least)
+        trace_record(TRACE_UNDERSTAND, traceStart, trace_now());
+
+        play_parsed_move(parsedInput);
+        free(parsedInput);
 }
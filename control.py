@@ -1,21 +1,39 @@
 from ctypes import *
 import ctypes
+import sys
+from recognizer import ReplayRecognizer, stream_move
 
 so_file = "chess_algorithm.so"
 
 chess_algorithm = CDLL(so_file)
 chess_algorithm.run_chess_algorithm.argtypes = c_char_p,
+chess_algorithm.understand_partial.restype = c_bool
+chess_algorithm.is_running.restype = c_bool
+chess_algorithm.has_tts.restype = c_bool
+chess_algorithm.tablebase_open.argtypes = c_char_p,
+chess_algorithm.tablebase_open.restype = c_bool
+
+# Moves are typed in, unless a transcript file is given to replay (one spoken move per line)
+recognizer = ReplayRecognizer(sys.argv[1]) if len(sys.argv) > 1 else None
+chess_algorithm.tablebase_open(b"tablebases") # Endgames are announced early if the tables are there, see tablebase_gen.c
 
 while True:
 	chess_algorithm.init_board()
 	chess_algorithm.print_board()
 
-	while chess_algorithm.running:
+	while chess_algorithm.is_running():
 		print ("White's turn:" if chess_algorithm.get_turn() == chess_algorithm.get_white() else "Black's turn:")
-		command = input()
-		b_command = command.encode()
+		if recognizer is not None:
+			chess_algorithm.play_parsed_move(stream_move(chess_algorithm, recognizer))
+		else:
+			command = input()
+			b_command = command.encode()
 
-		buf = create_string_buffer(128)
-		buf.value = b_command
-		chess_algorithm.run_chess_algorithm(buf)
-	chess_algorithm.reset_game()
+			buf = create_string_buffer(128)
+			buf.value = b_command
+			chess_algorithm.run_chess_algorithm(buf)
+		while chess_algorithm.has_commands(): # No motors attached here, discard the motion plan so the queue doesn't fill up
+			if chess_algorithm.get_command_type() == 0: chess_algorithm.get_int_command_value()
+			else: chess_algorithm.get_float_command_value_b()
+		while chess_algorithm.has_tts(): # Nor a speaker, messages are already printed as they are announced
+			chess_algorithm.get_tts()
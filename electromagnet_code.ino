@@ -1,8 +1,103 @@
+// Electromagnet driver test and settle-time calibration
+// The magnet's MOSFET gate is on pin 11 (PWM), and a hall sensor beside the magnet face is read on A0.
+// During games the board runs StandardFirmata and the host ramps the magnet itself (see motion.py);
+// flash this sketch to measure how long each piece takes to settle, driven by "python3 calibrate.py magnet PORT".
+//
+// Serial commands, one per line at 57600 baud:
+//   R <rampUpMs> <rampDownMs> <holdDuty> <boostDuty>   ramp settings, duties out of 255
+//   1                                                  magnet on: ramp up to boost, then drop to hold
+//   0                                                  magnet off: ramp down
+//   C                                                  calibrate with the piece under the magnet, replies "SETTLE <onMs> <offMs>"
+
+#define magnetPin 11
+#define sensorPin A0
+
+#define rampSteps 8 // Same as RAMP_STEPS in motion.py, so the ramps match what the host does
+#define settleTolerance 3 // Sensor counts the reading may wander by once the piece has settled
+#define stableMs 50 // How long the reading has to stay put
+#define timeoutMs 3000
+#define trials 5 // The slowest of these is reported
+
+int rampUpMs = 150;
+int rampDownMs = 100;
+int holdDuty = 153;
+int boostDuty = 255;
+int duty = 0;
+
 void setup() {
-  pinMode(13, OUTPUT);
+  pinMode(magnetPin, OUTPUT);
+  analogWrite(magnetPin, 0);
+  Serial.begin(57600);
+}
+
+void rampTo(int target, int ms) {
+  int start = duty;
+  for (int i = 1; i <= rampSteps; i++) {
+    duty = start + (long) (target - start) * i / rampSteps;
+    analogWrite(magnetPin, duty);
+    delay(ms / rampSteps);
+  }
+}
+
+// Milliseconds from "start" until the sensor reading stops changing (the piece has stopped moving)
+unsigned long waitUntilStable(unsigned long start) {
+  int reference = analogRead(sensorPin);
+  unsigned long stableSince = millis();
+  while (millis() - start < timeoutMs) {
+    int reading = analogRead(sensorPin);
+    if (abs(reading - reference) > settleTolerance) {
+      reference = reading;
+      stableSince = millis();
+    } else if (millis() - stableSince >= stableMs) {
+      return stableSince - start;
+    }
+    delay(1);
+  }
+  return timeoutMs;
+}
+
+void calibrate() {
+  unsigned long slowestOn = 0;
+  unsigned long slowestOff = 0;
+  for (int i = 0; i < trials; i++) {
+    unsigned long start = millis();
+    rampTo(boostDuty, rampUpMs);
+    slowestOn = max(slowestOn, waitUntilStable(start));
+
+    rampTo(holdDuty, 0);
+    delay(200);
+
+    start = millis();
+    rampTo(0, rampDownMs);
+    slowestOff = max(slowestOff, waitUntilStable(start));
+    delay(300);
+  }
+
+  Serial.print("SETTLE ");
+  Serial.print(slowestOn);
+  Serial.print(" ");
+  Serial.println(slowestOff);
 }
 
 void loop() {
-  digitalWrite(13, LOW);
-  delay(10000);
+  if (!Serial.available()) return;
+
+  char command = Serial.read();
+  if (command == 'R') {
+    rampUpMs = Serial.parseInt();
+    rampDownMs = Serial.parseInt();
+    holdDuty = Serial.parseInt();
+    boostDuty = Serial.parseInt();
+    Serial.println("OK");
+  } else if (command == '1') {
+    rampTo(boostDuty, rampUpMs);
+    delay(200);
+    rampTo(holdDuty, 0);
+    Serial.println("OK");
+  } else if (command == '0') {
+    rampTo(0, rampDownMs);
+    Serial.println("OK");
+  } else if (command == 'C') {
+    calibrate();
+  }
 }
@@ -0,0 +1,272 @@
+from ctypes import c_float
+import copy
+import json
+import math
+import time
+
+# Step generation for one rig: turns the chess library's command queue into step, direction and magnet pin writes.
+# Nothing in here sleeps. step() does the next bit of work and says how long to wait before calling it again,
+# so a controller can either sleep in between (test.py) or interleave several rigs (multi_control.py).
+
+# Hardware pins (don't change!!)
+MOTOR_ENABLE = 8
+MOTOR_X_DIR = 5
+MOTOR_Y_DIR = 6
+MOTOR_Z_DIR = 7
+MOTOR_X_STEP = 2
+MOTOR_Y_STEP = 3
+MOTOR_Z_STEP = 4
+ELECTROMAGNET = 11 # Driven with PWM, so it needs a PWM-capable pin (13 isn't)
+OUTPUT_PINS = [MOTOR_X_STEP, MOTOR_Y_STEP, MOTOR_Z_STEP, MOTOR_X_DIR, MOTOR_Y_DIR, MOTOR_Z_DIR, MOTOR_ENABLE]
+
+# Linear motion
+# Tile A1 is the vertex of the sides with the motors
+# Steps per tile and speed limits come from the rig profile (see calibrate.py); these are the defaults for an uncalibrated rig
+UNIT_STEP = 222 # Moves motor exactly 1 tile
+LOADED_STEP_SECONDS = 0.0015 # Slower while dragging a piece
+UNLOADED_STEP_SECONDS = 0.0001
+
+# Electromagnet
+# The magnet is ramped up to full strength to pick a piece up, and kept there while the carriage gets going, then drops to a
+# lower holding strength so the coil doesn't overheat. Ramps and settle times come from the rig profile (see calibrate.py).
+RAMP_STEPS = 8 # PWM writes per ramp
+PIECE_NAMES = ["pawn", "knight", "bishop", "rook", "queen", "king"] # Indexed by the piece id magnet commands carry
+PROFILE_FILE = "rig_profile.json"
+DEFAULT_AXIS = {
+	"stepsPerTile": UNIT_STEP,
+	"unloaded": {"rate": 1 / UNLOADED_STEP_SECONDS, "accel": 0}, # Steps per second, and steps per second squared (0 starts at full rate)
+	"loaded": {"rate": 1 / LOADED_STEP_SECONDS, "accel": 0},
+}
+DEFAULT_PROFILE = {
+	"axes": { # "file" is the X/Z gantry, "rank" the Y carriage
+		"file": copy.deepcopy(DEFAULT_AXIS),
+		"rank": copy.deepcopy(DEFAULT_AXIS),
+	},
+	"magnet": {
+		"boost": 1.0, # Duty cycle while picking a piece up and while accelerating
+		"hold": 0.6, # Duty cycle once the carriage is under way
+		"boostSteps": 150, # Steps at the start of every loaded segment that are done at boost
+		"rampUpSeconds": 0.15,
+		"rampDownSeconds": 0.1,
+		"settleSeconds": { # From the start of the ramp until the piece has settled; per piece name, "default" for the rest
+			"default": {"on": 2.0, "off": 2.0},
+		},
+	},
+}
+
+# Stages recorded from here (see TRACE_* in chess_algorithm.c)
+TRACE_MOTOR = 4
+TRACE_MAGNET = 5
+
+# Loads a rig profile, filling in anything it doesn't set from DEFAULT_PROFILE; a missing file gives the defaults
+def load_profile(path=PROFILE_FILE):
+	profile = copy.deepcopy(DEFAULT_PROFILE)
+	try:
+		with open(path) as file:
+			merge_profile(profile, json.load(file))
+	except FileNotFoundError:
+		pass
+	return profile
+
+def merge_profile(profile, overrides):
+	for key, value in overrides.items():
+		if isinstance(value, dict) and isinstance(profile.get(key), dict):
+			merge_profile(profile[key], value)
+		else:
+			profile[key] = value
+
+class Motion:
+	# "write" is called as write(pin, value) to set a digital output on the rig, and "pwm" as pwm(pin, duty) with a duty cycle in [0, 1]
+	def __init__(self, chess_algorithm, write, pwm, profile=None):
+		self.chess_algorithm = chess_algorithm
+		self.write = write
+		self.pwm = pwm
+		self.profile = profile if profile is not None else load_profile()
+		self.pins = {} # Last value written to each pin, unchanged pins aren't written again
+
+		magnet = self.profile["magnet"]
+		settle = magnet["settleSeconds"]
+		chess_algorithm.set_magnet_toggle_seconds.argtypes = c_float,
+		chess_algorithm.set_magnet_toggle_seconds(sum(s["on"] + s["off"] for s in settle.values()) / (2 * len(settle))) # So the planner weighs toggles right
+
+		axes = self.profile["axes"]
+		self.fileStep = axes["file"]["stepsPerTile"]
+		self.rankStep = axes["rank"]["stepsPerTile"]
+		self.limits = {(axis, load): (axes[axis][load]["rate"], axes[axis][load]["accel"]) for axis in ("file", "rank") for load in ("unloaded", "loaded")}
+		tileSeconds = [max(axes[axis]["stepsPerTile"] / axes[axis][load]["rate"] for axis in ("file", "rank")) for load in ("unloaded", "loaded")]
+		chess_algorithm.set_tile_seconds.argtypes = c_float, c_float
+		chess_algorithm.set_tile_seconds(*tileSeconds) # At full speed, so short moves come out a little optimistic
+
+		self.targetFilePos = 0 # (0-2220)
+		self.targetRankPos = 0
+		self.targetMagnetState = 0
+		self.curFilePos = 0
+		self.curRankPos = 0
+		self.curMagnetState = 0
+		self.plannedFilePos = 0 # Where the library's plan has the carriage once the commands taken so far are done
+		self.plannedRankPos = 0
+		self.parking = False # Heading for where the library parked the carriage to wait for the next move (see park_carriage())
+
+		self.magnetActions = [] # (duty, seconds to wait after writing it) still to do for the current magnet toggle
+		self.magnetPiece = -1 # Piece id the current magnet command is for
+		self.segmentSteps = 0 # Steps done in the current motor segment
+
+		self.pulsing = False # Step pins are high
+		self.segmentStart = None # Trace timestamp of the motor segment currently being executed
+		self.magnetStart = None # Trace timestamp of the magnet toggle that is settling
+		self.steps = 0
+		self.commands = 0
+
+		self.write_pin(MOTOR_ENABLE, 0)
+
+	def write_pin(self, pin, value):
+		if self.pins.get(pin) != value:
+			self.pins[pin] = value
+			self.write(pin, value)
+
+	def write_duty(self, duty):
+		if self.pins.get(ELECTROMAGNET) != duty:
+			self.pins[ELECTROMAGNET] = duty
+			self.pwm(ELECTROMAGNET, duty)
+
+	def settle_seconds(self, pieceId, direction):
+		settle = self.profile["magnet"]["settleSeconds"]
+		name = PIECE_NAMES[pieceId] if 0 <= pieceId < len(PIECE_NAMES) else None
+		return settle.get(name, settle["default"])[direction]
+
+	# PWM writes that ramp the magnet on or off, the last one followed by the rest of the piece's settle time
+	def magnet_ramp(self, on):
+		magnet = self.profile["magnet"]
+		start = self.pins.get(ELECTROMAGNET, 0)
+		end = magnet["boost"] if on else 0
+		rampSeconds = magnet["rampUpSeconds" if on else "rampDownSeconds"]
+		interval = rampSeconds / RAMP_STEPS
+		actions = [(start + (end - start) * (i + 1) / RAMP_STEPS, interval) for i in range(RAMP_STEPS)]
+		actions[-1] = (end, max(interval, self.settle_seconds(self.magnetPiece, "on" if on else "off") - rampSeconds + interval))
+		return actions
+
+	# Seconds until the next step, for the axes about to move; each axis speeds up from a standstill at the start of a segment
+	# and slows down again towards its end, within the limits measured for it
+	def step_seconds(self, fileSteps, rankSteps):
+		load = "loaded" if self.curMagnetState == 1 else "unloaded"
+		rate = math.inf
+		for axis, remaining in (("file", fileSteps), ("rank", rankSteps)):
+			if(remaining == 0):
+				continue
+			axisRate, accel = self.limits[(axis, load)]
+			if(accel > 0):
+				axisRate = min(axisRate, math.sqrt(2 * accel * (min(self.segmentSteps, remaining) + 1)))
+			rate = min(rate, axisRate)
+		return 1 / rate
+
+	def at_target(self):
+		return self.curFilePos == self.targetFilePos and self.curRankPos == self.targetRankPos and self.curMagnetState == self.targetMagnetState
+
+	# Ends the step pulse started last time
+	def end_pulse(self):
+		if(self.pulsing):
+			self.write_pin(MOTOR_X_STEP, 0)
+			self.write_pin(MOTOR_Y_STEP, 0)
+			self.write_pin(MOTOR_Z_STEP, 0)
+			self.pulsing = False
+
+	# Takes the next command off the library's queue
+	def next_command(self):
+		chess_algorithm = self.chess_algorithm
+		command_type = chess_algorithm.get_command_type()
+		if(command_type in (1, 2, 3)): # Parks aren't part of any move, so they aren't traced
+			self.segmentStart = chess_algorithm.trace_now()
+		if(command_type == 0): # Toggle magnet
+			self.magnetPiece = round(chess_algorithm.get_float_command_value_a()) # Read before the value below pops the command
+			self.targetMagnetState = chess_algorithm.get_int_command_value()
+		elif(command_type == 1): # Change file
+			self.plannedFilePos += chess_algorithm.get_float_command_value_b() * self.fileStep
+		elif(command_type == 2): # Change rank
+			self.plannedRankPos += chess_algorithm.get_float_command_value_b() * self.rankStep
+		elif(command_type == 3 or command_type == 4): # Change rank AND file, or park
+			self.plannedFilePos += chess_algorithm.get_float_command_value_a() * self.fileStep
+			self.plannedRankPos += chess_algorithm.get_float_command_value_b() * self.rankStep
+		# Relative to where the plan has the carriage rather than where it is, so a park cut short doesn't throw the next move off
+		self.targetFilePos = round(self.plannedFilePos)
+		self.targetRankPos = round(self.plannedRankPos)
+		self.parking = command_type == 4
+		self.segmentSteps = 0
+		self.commands += 1
+
+	# Does the next bit of work towards carrying out the plan
+	# Returns the number of seconds to wait before calling again, or None once the plan is done and the rig is idle (but for a park, see idle_step())
+	def step(self):
+		chess_algorithm = self.chess_algorithm
+		self.end_pulse()
+		if(self.magnetActions): # Ramping the magnet
+			duty, seconds = self.magnetActions.pop(0)
+			self.write_duty(duty)
+			return seconds
+		if(self.magnetStart is not None): # Magnet has settled
+			chess_algorithm.trace_record(TRACE_MAGNET, self.magnetStart, chess_algorithm.trace_now())
+			self.magnetStart = None
+
+		if(self.parking):
+			if(not chess_algorithm.has_commands()): # Nothing else to do, the controller carries on with the park from idle_step()
+				return None
+			self.parking = False
+			if(chess_algorithm.get_command_type() != 0): # Next move is in, head straight for its first position from wherever the carriage has got to
+				self.next_command()
+				return 0
+
+		if(self.at_target()): # Check for next command
+			if(self.segmentStart is not None): # Previous motor segment has been reached
+				chess_algorithm.trace_record(TRACE_MOTOR, self.segmentStart, chess_algorithm.trace_now())
+				self.segmentStart = None
+			if(not chess_algorithm.has_commands()):
+				return None
+			self.next_command()
+			return 0
+
+		# Configure hardware to reach target states
+		if(self.targetMagnetState != self.curMagnetState): # Toggle magnet
+			self.curMagnetState = self.targetMagnetState
+			self.magnetActions = self.magnet_ramp(self.curMagnetState == 1)
+			self.magnetStart = chess_algorithm.trace_now()
+			return 0
+		return self.move_step()
+
+	# One step of both axes towards the target position; doesn't touch the library
+	def move_step(self):
+		self.write_pin(MOTOR_X_DIR, 0 if self.curFilePos < self.targetFilePos else 1)
+		self.write_pin(MOTOR_Y_DIR, 1 if self.curRankPos < self.targetRankPos else 0)
+		self.write_pin(MOTOR_Z_DIR, 1 if self.curFilePos < self.targetFilePos else 0)
+
+		# Hold the piece harder while the carriage gets going
+		if(self.curMagnetState == 1):
+			magnet = self.profile["magnet"]
+			self.write_duty(magnet["boost"] if self.segmentSteps < magnet["boostSteps"] else magnet["hold"])
+		delay = self.step_seconds(abs(self.targetFilePos - self.curFilePos), abs(self.targetRankPos - self.curRankPos))
+		self.segmentSteps += 1
+		if(self.curFilePos != self.targetFilePos): # Move motors that control file
+			self.write_pin(MOTOR_X_STEP, 1)
+			self.write_pin(MOTOR_Z_STEP, 1)
+			self.curFilePos += (1 if self.targetFilePos > self.curFilePos else -1)
+		if(self.curRankPos != self.targetRankPos):
+			self.write_pin(MOTOR_Y_STEP, 1)
+			self.curRankPos += (1 if self.targetRankPos > self.curRankPos else -1)
+		self.pulsing = True
+		self.steps += 1
+		return delay
+
+	# Carries on with a park while the players think, and can be called from another thread meanwhile as it doesn't touch the library
+	# Returns the number of seconds to wait before calling again, or None once there's nothing to do until step() is called again
+	def idle_step(self):
+		self.end_pulse()
+		if(not self.parking or (self.curFilePos == self.targetFilePos and self.curRankPos == self.targetRankPos)):
+			return None
+		return self.move_step()
+
+	# Runs the whole plan, sleeping between steps
+	def run(self):
+		while True:
+			delay = self.step()
+			if(delay is None):
+				return
+			if(delay > 0):
+				time.sleep(delay)
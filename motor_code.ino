@@ -1,52 +1,149 @@
+// Motor test and step-rate calibration
+// Endstops (switch to ground) sit at the A1 end of each axis: the file gantry's on pin 9, the rank carriage's on pin 10.
+// Flash this sketch and run "python3 calibrate.py axes PORT"; during games the board runs StandardFirmata instead.
+//
+// Serial commands, one per line at 57600 baud. Axis F is the file gantry (X and Z, stepped together), R the rank carriage (Y).
+//   E <0|1>                                           motor drivers off (the carriage can be pushed by hand) or on
+//   F <axis>                                          steps back to the endstop, replies "FOUND <steps>" (-1 if it never got there),
+//                                                     then backs off a little so trials start clear of the switch
+//   T <axis> <rate> <accel> <steps> <loaded>          out and back from there at up to <rate> steps/s, speeding up and slowing down at
+//                                                     <accel> steps/s/s (0 for none), with the magnet on if <loaded>, then finds the
+//                                                     endstop again; replies "TRIAL <steps lost>"
+
 #define motorXStep 2
 #define motorYStep 3
 #define motorZStep 4
-#define motorAStep 12
 
 #define motorXDir 5
 #define motorYDir 6
 #define motorZDir 7
-#define motorADir 13
 
 #define enableMotors 8
+#define fileEndstop 9
+#define rankEndstop 10
+#define magnetPin 11
+
+#define homeOffset 200 // Steps backed off from the endstop
+#define seekRate 400 // Steps per second while finding the endstop, slow enough that it never skips
+#define maxSeekSteps 20000
 
-void setup()
-{
+void setup() {
   pinMode(motorXStep, OUTPUT);
   pinMode(motorYStep, OUTPUT);
   pinMode(motorZStep, OUTPUT);
-  pinMode(motorAStep, OUTPUT);
 
   pinMode(motorXDir, OUTPUT);
   pinMode(motorYDir, OUTPUT);
   pinMode(motorZDir, OUTPUT);
-  pinMode(motorADir, OUTPUT);
 
-  digitalWrite(8, LOW);
+  pinMode(enableMotors, OUTPUT);
+  pinMode(fileEndstop, INPUT_PULLUP);
+  pinMode(rankEndstop, INPUT_PULLUP);
+  pinMode(magnetPin, OUTPUT);
+
+  digitalWrite(enableMotors, LOW);
+  analogWrite(magnetPin, 0);
+  Serial.begin(57600);
 }
 
-void loop()
-{
-  
-  digitalWrite(motorXDir, HIGH); // downwards -> LOW
-  digitalWrite(motorYDir, LOW); // left -> HIGH
-  digitalWrite(motorZDir, LOW); // downwards -> HIGH
-  digitalWrite(motorADir, HIGH);
+// Sets which way the axis turns: "away" is away from the endstop, same directions as motion.py
+void setDirection(char axis, bool away) {
+  if (axis == 'F') {
+    digitalWrite(motorXDir, away ? LOW : HIGH);
+    digitalWrite(motorZDir, away ? HIGH : LOW); // Z mirrors X
+  } else {
+    digitalWrite(motorYDir, away ? HIGH : LOW);
+  }
+}
 
-  for (int i = 0; i < 10000; i++)
-  {
+void pulse(char axis) {
+  if (axis == 'F') {
     digitalWrite(motorXStep, HIGH);
-    digitalWrite(motorYStep, HIGH);
     digitalWrite(motorZStep, HIGH);
-    digitalWrite(motorAStep, HIGH);
-
     digitalWrite(motorXStep, LOW);
-    digitalWrite(motorYStep, LOW);
     digitalWrite(motorZStep, LOW);
-    digitalWrite(motorAStep, LOW);
+  } else {
+    digitalWrite(motorYStep, HIGH);
+    digitalWrite(motorYStep, LOW);
+  }
+}
+
+bool atEndstop(char axis) {
+  return digitalRead(axis == 'F' ? fileEndstop : rankEndstop) == LOW;
+}
+
+// Moves "steps" steps, ramping up from a standstill and back down to one
+void move(char axis, bool away, long steps, float rate, float accel) {
+  setDirection(axis, away);
+  unsigned long next = micros();
+  for (long i = 0; i < steps; i++) {
+    float speed = rate;
+    if (accel > 0) speed = min(rate, sqrt(2 * accel * (min(i, steps - i - 1) + 1)));
+    while ((long) (micros() - next) < 0);
+    pulse(axis);
+    next += 1000000.0 / speed;
+  }
+}
+
+// Steps taken to reach the endstop, or -1
+long findEndstop(char axis) {
+  setDirection(axis, false);
+  long steps = 0;
+  while (!atEndstop(axis)) {
+    if (steps == maxSeekSteps) return -1;
+    pulse(axis);
+    steps++;
+    delayMicroseconds(1000000 / seekRate);
+  }
+  move(axis, true, homeOffset, seekRate, 0);
+  return steps;
+}
+
+// Next space-separated field of the command line being parsed, "" if there are no more
+const char *field() {
+  const char *token = strtok(NULL, " \r");
+  return token == NULL ? "" : token;
+}
+
+void loop() {
+  if (!Serial.available()) return;
+
+  // Whole line first: the arguments arrive a byte at a time after the command letter, so reading them straight away finds nothing
+  char line[64];
+  int length = Serial.readBytesUntil('\n', line, sizeof(line) - 1);
+  line[length] = '\0';
+  const char *token = strtok(line, " \r");
+  if (token == NULL) return;
+
+  char command = token[0];
+  if (command == 'E') {
+    digitalWrite(enableMotors, atoi(field()) == 1 ? LOW : HIGH);
+    Serial.println("OK");
+    return;
+  }
+  if (command != 'F' && command != 'T') return;
+
+  char axis = field()[0];
+  if (axis != 'F' && axis != 'R') {
+    Serial.println("UNKNOWN AXIS");
+    return;
+  }
+  if (command == 'F') {
+    Serial.print("FOUND ");
+    Serial.println(findEndstop(axis));
+  } else {
+    float rate = atof(field());
+    float accel = atof(field());
+    long steps = atol(field());
+    bool loaded = atoi(field()) == 1;
+
+    if (loaded) analogWrite(magnetPin, 255);
+    move(axis, true, steps, rate, accel);
+    move(axis, false, steps, rate, accel);
+    if (loaded) analogWrite(magnetPin, 0);
 
-    delay(1);
+    long found = findEndstop(axis);
+    Serial.print("TRIAL ");
+    Serial.println(found < 0 ? maxSeekSteps : abs(found - homeOffset));
   }
-  
-  delay(10000);
 }
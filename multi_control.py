@@ -0,0 +1,270 @@
+from ctypes import *
+import heapq
+import os
+import shutil
+import sys
+import tempfile
+import termios
+import threading
+import time
+import tty
+from motion import Motion, ELECTROMAGNET, OUTPUT_PINS, load_profile
+from recognizer import AzureRecognizer, ReplayRecognizer, stream_move
+
+# Drives several boards from one host process.
+# The chess library keeps its game in globals, so every board loads a private copy of chess_algorithm.so.
+# Each board also gets its own serial link, which is written without blocking, and its own recognizer.
+# Boards are scheduled by when their next step is due. Each turn of the scheduler does one step for one board, so a
+# board that is settling its magnet, listening for a move or stuck behind a full serial buffer never holds up the others.
+#     python3 multi_control.py PORT[=TRANSCRIPT] [PORT[=TRANSCRIPT] ...]
+#     python3 multi_control.py --simulate TRANSCRIPT [TRANSCRIPT ...]   (one simulated rig per transcript, see sim_serial.py)
+# Boards without a transcript listen on the default microphone.
+
+so_file = "chess_algorithm.so"
+
+BAUD_RATE = termios.B57600 # StandardFirmata
+MAX_BACKLOG = 4096 # Bytes waiting for a board's serial link before its steps are held back
+BACKLOG_RETRY_SECONDS = 0.005
+LISTEN_POLL_SECONDS = 0.02
+REPORT_SECONDS = 10
+ARCHIVE_DIRECTORY = b"archive" # Shared by every board, see archive_query.c
+
+# Firmata commands
+DIGITAL_MESSAGE = 0x90
+ANALOG_MESSAGE = 0xE0 # Also sets PWM outputs
+SET_PIN_MODE = 0xF4
+OUTPUT = 1
+PWM = 3
+
+class FirmataLink:
+	# Minimal, non-blocking Firmata writer for the digital outputs the rigs use
+	def __init__(self, path):
+		self.path = path
+		self.fd = os.open(path, os.O_RDWR | os.O_NOCTTY | os.O_NONBLOCK)
+		tty.setraw(self.fd)
+		attributes = termios.tcgetattr(self.fd)
+		attributes[4] = attributes[5] = BAUD_RATE
+		termios.tcsetattr(self.fd, termios.TCSANOW, attributes)
+
+		self.outgoing = bytearray()
+		self.ports = [0] * 16 # Firmata writes 8 pins (a port) at a time
+		self.bytesWritten = 0
+		self.stalls = 0 # Flushes that couldn't write everything
+		self.maxBacklog = 0
+		for pin in OUTPUT_PINS:
+			self.outgoing += bytes([SET_PIN_MODE, pin, OUTPUT])
+		self.outgoing += bytes([SET_PIN_MODE, ELECTROMAGNET, PWM])
+
+	def digital_write(self, pin, value):
+		port = pin // 8
+		if(value):
+			self.ports[port] |= 1 << (pin % 8)
+		else:
+			self.ports[port] &= ~(1 << (pin % 8))
+		self.outgoing += bytes([DIGITAL_MESSAGE | port, self.ports[port] & 0x7F, (self.ports[port] >> 7) & 0x7F])
+		self.maxBacklog = max(self.maxBacklog, len(self.outgoing))
+
+	def analog_write(self, pin, duty):
+		value = round(duty * 255)
+		self.outgoing += bytes([ANALOG_MESSAGE | pin, value & 0x7F, (value >> 7) & 0x7F])
+		self.maxBacklog = max(self.maxBacklog, len(self.outgoing))
+
+	def flush(self):
+		try:
+			os.read(self.fd, 4096) # Discard anything the board reports back
+		except (BlockingIOError, OSError):
+			pass
+		if(len(self.outgoing) == 0):
+			return
+		try:
+			written = os.write(self.fd, self.outgoing)
+		except BlockingIOError:
+			written = 0
+		if(written < len(self.outgoing)):
+			self.stalls += 1
+		del self.outgoing[:written]
+		self.bytesWritten += written
+
+	def backlog(self):
+		return len(self.outgoing)
+
+	def close(self):
+		os.close(self.fd)
+
+def load_private_library(index, directory):
+	path = os.path.join(directory, "chess_algorithm_{}.so".format(index))
+	shutil.copy(os.path.abspath(so_file), path) # dlopen() shares one copy between every load of the same file
+	chess_algorithm = CDLL(path)
+	chess_algorithm.get_int_command_value.restype = c_int32
+	chess_algorithm.get_float_command_value_a.restype = c_float
+	chess_algorithm.get_float_command_value_b.restype = c_float
+	chess_algorithm.get_tts.restype = c_char_p
+	chess_algorithm.has_tts.restype = c_bool
+	chess_algorithm.is_running.restype = c_bool
+	chess_algorithm.has_commands.restype = c_bool
+	chess_algorithm.understand_partial.restype = c_bool
+	chess_algorithm.trace_now.restype = c_longlong
+	chess_algorithm.trace_record.argtypes = c_int, c_longlong, c_longlong
+	chess_algorithm.get_plan_cache_hits.restype = c_longlong
+	chess_algorithm.get_plan_cache_misses.restype = c_longlong
+	chess_algorithm.archive_open.argtypes = c_char_p,
+	chess_algorithm.archive_open.restype = c_bool
+	chess_algorithm.set_debug_logging(False) # Several boards share one terminal
+	return chess_algorithm
+
+class Board:
+	def __init__(self, index, port, transcript, libraryDirectory, profile):
+		self.name = "board {}".format(index)
+		self.chess_algorithm = load_private_library(index, libraryDirectory)
+		self.link = FirmataLink(port)
+		self.motion = Motion(self.chess_algorithm, self.link.digital_write, self.link.analog_write, profile)
+		if(transcript is not None):
+			self.recognizer = ReplayRecognizer(transcript)
+		else:
+			self.recognizer = AzureRecognizer(subscription="f84602d441ba4ce6b6ff2aa108185ba9", region="eastus")
+
+		self.listener = None # Thread listening for the next move
+		self.parsed = None # Move it heard, or None while still listening
+		self.finished = False
+
+		# Health and latency counters
+		self.state = "starting"
+		self.moves = 0
+		self.planFailures = 0
+		self.ticks = 0
+		self.latenessTotal = 0.0 # How late the scheduler got to this board's steps, in seconds
+		self.latenessMax = 0.0
+		self.heldBack = 0 # Times steps were held back because the serial link was backed up
+		self.listenSeconds = 0.0
+		self.listenStart = None
+
+		if(not self.chess_algorithm.archive_open(ARCHIVE_DIRECTORY)):
+			self.say("couldn't open the game archive, its games won't be kept")
+		self.chess_algorithm.init_board()
+
+	def say(self, message):
+		print("[{}] {}".format(self.name, message))
+
+	def listen(self):
+		try:
+			self.parsed = stream_move(self.chess_algorithm, self.recognizer)
+		except EOFError: # Nothing left to replay
+			self.parsed = False
+
+	def narrate(self):
+		while self.chess_algorithm.has_tts():
+			self.say("says: " + self.chess_algorithm.get_tts().decode())
+
+	# Does the next bit of work for this board; returns when it next needs attention, or None once it's finished
+	def tick(self, now, due):
+		self.ticks += 1
+		lateness = now - due
+		self.latenessTotal += lateness
+		self.latenessMax = max(self.latenessMax, lateness)
+
+		self.link.flush()
+		if(self.link.backlog() > MAX_BACKLOG): # Let the link catch up before generating more steps
+			self.state = "backed up"
+			self.heldBack += 1
+			return now + BACKLOG_RETRY_SECONDS
+
+		if(self.listener is not None):
+			if(self.listener.is_alive()):
+				delay = self.motion.idle_step() # Carries on parking the carriage meanwhile
+				return now + (LISTEN_POLL_SECONDS if delay is None else delay)
+			self.listener = None
+			self.listenSeconds += now - self.listenStart
+			if(self.parsed is False):
+				self.say("out of moves to replay")
+				return self.finish()
+			self.chess_algorithm.play_parsed_move(self.parsed)
+			self.moves += 1
+			if(self.chess_algorithm.get_plan_status() != 0):
+				self.planFailures += 1
+		self.narrate() # Not while listening, the listener thread has the library
+
+		delay = self.motion.step()
+		if(delay is not None):
+			self.state = "moving"
+			return now + delay
+
+		if(not self.chess_algorithm.is_running()):
+			self.say("game over")
+			return self.finish()
+
+		self.state = "listening"
+		self.parsed = None
+		self.listenStart = now
+		self.listener = threading.Thread(target=self.listen, daemon=True) # The library isn't touched by the scheduler meanwhile
+		self.listener.start()
+		return now + LISTEN_POLL_SECONDS
+
+	def finish(self):
+		self.link.flush()
+		self.state = "finished"
+		self.finished = True
+		return None
+
+	def report(self):
+		hits = self.chess_algorithm.get_plan_cache_hits()
+		lookups = hits + self.chess_algorithm.get_plan_cache_misses()
+		return "{:<8} {:<10} {:>5} {:>8} {:>6} {:>9.1f} {:>9.1f} {:>8} {:>6} {:>6} {:>7.1f} {:>5} {:>6.1f}".format(self.name, self.state, self.moves,
+			self.motion.steps, self.motion.commands, 1e6 * self.latenessTotal / max(1, self.ticks), 1e6 * self.latenessMax, self.link.maxBacklog,
+			self.link.stalls, self.heldBack, self.listenSeconds, self.planFailures, 100 * hits / max(1, lookups))
+
+def print_report(boards):
+	print("{:<8} {:<10} {:>5} {:>8} {:>6} {:>9} {:>9} {:>8} {:>6} {:>6} {:>7} {:>5} {:>6}".format("board", "state", "moves", "steps", "cmds",
+		"late_us", "late_max", "backlog", "stalls", "held", "listen", "fails", "cache%"))
+	for board in boards:
+		print(board.report())
+
+# Runs every board until all of them are finished
+def run(boards):
+	schedule = [(time.perf_counter(), i) for i in range(len(boards))] # (when the board next needs attention, board index)
+	heapq.heapify(schedule)
+	nextReport = time.perf_counter() + REPORT_SECONDS
+
+	while schedule:
+		due, i = heapq.heappop(schedule)
+		wait = due - time.perf_counter()
+		if(wait > 0):
+			time.sleep(wait)
+
+		now = time.perf_counter()
+		nextDue = boards[i].tick(now, due)
+		if(nextDue is not None):
+			heapq.heappush(schedule, (nextDue, i))
+
+		if(now >= nextReport):
+			print_report(boards)
+			nextReport = now + REPORT_SECONDS
+
+if __name__ == '__main__':
+	args = sys.argv[1:]
+	rigs = []
+	if(len(args) > 0 and args[0] == "--simulate"):
+		from sim_serial import SimulatedRig
+		rigs = [SimulatedRig("rig {}".format(i)).start() for i in range(len(args) - 1)]
+		specs = [(rig.path, transcript) for rig, transcript in zip(rigs, args[1:])]
+	else:
+		specs = [(arg.split("=", 1)[0], arg.split("=", 1)[1] if "=" in arg else None) for arg in args]
+	if(len(specs) == 0):
+		print("Usage: python3 multi_control.py PORT[=TRANSCRIPT] [PORT[=TRANSCRIPT] ...] | --simulate TRANSCRIPT [TRANSCRIPT ...]")
+		sys.exit(2)
+
+	libraryDirectory = tempfile.mkdtemp(prefix="chessboards")
+	profile = load_profile() # Every rig on one host shares the profile for now
+	boards = [Board(i, port, transcript, libraryDirectory, profile) for i, (port, transcript) in enumerate(specs)]
+	try:
+		run(boards)
+	except KeyboardInterrupt:
+		pass
+	finally:
+		print_report(boards)
+		for board in boards:
+			board.link.close()
+			board.chess_algorithm.archive_close()
+		for rig in rigs:
+			time.sleep(0.2) # Let the rig decode what is still in the pty
+			print(rig.status())
+		shutil.rmtree(libraryDirectory)
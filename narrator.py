@@ -0,0 +1,36 @@
+import queue
+import threading
+import pyttsx3
+
+# Speaks narration on its own thread, so that the motion loop keeps stepping the motors while a message plays.
+# It takes one message at a time: hand the next one over only once idle(), so that everything not yet heard stays in the
+# narration queue in chess_algorithm.c, which prioritises and coalesces it (see queue_tts()).
+
+class Narrator:
+	def __init__(self, trace_now):
+		self.messages = queue.Queue()
+		self.busy = threading.Event() # Set from say() until the message has been spoken
+		self.spans = queue.Queue() # (start, end) of every message spoken, recorded by the main thread (the trace buffer isn't thread-safe)
+		self.trace_now = trace_now
+		threading.Thread(target=self.run, daemon=True).start()
+
+	def say(self, message):
+		self.busy.set()
+		self.messages.put(message)
+
+	def idle(self):
+		return not self.busy.is_set()
+
+	def finished_spans(self):
+		while not self.spans.empty():
+			yield self.spans.get()
+
+	def run(self):
+		engine = pyttsx3.init() # The engine has to be driven from the thread that created it
+		while True:
+			message = self.messages.get()
+			start = self.trace_now()
+			engine.say(message)
+			engine.runAndWait()
+			self.spans.put((start, self.trace_now()))
+			self.busy.clear()
@@ -0,0 +1,73 @@
+from ctypes import *
+import queue
+import time
+
+# Speech input for the chessboard controllers.
+# A recognizer streams hypotheses for one utterance at a time: listen() yields (text, isFinal) pairs, where every
+# partial hypothesis holds everything heard so far and the last pair is the final result.
+# stream_move() feeds those hypotheses into the chess library, which commits the move as soon as it is unambiguous.
+
+class Recognizer:
+	def listen(self):
+		raise NotImplementedError
+
+class AzureRecognizer(Recognizer):
+	def __init__(self, subscription, region):
+		import azure.cognitiveservices.speech as speechsdk # Only needed on the real board
+
+		self.speech_recognizer = speechsdk.SpeechRecognizer(speech_config=speechsdk.SpeechConfig(subscription=subscription, region=region))
+		self.events = queue.Queue()
+		self.speech_recognizer.recognizing.connect(lambda evt: self.events.put((evt.result.text, False))) # Partial hypothesis
+		self.speech_recognizer.recognized.connect(lambda evt: self.events.put((evt.result.text, True))) # End of utterance
+		self.speech_recognizer.canceled.connect(lambda evt: self.events.put(("", True)))
+
+	def listen(self):
+		while not self.events.empty(): # Drop anything left over from the previous utterance
+			self.events.get()
+
+		self.speech_recognizer.start_continuous_recognition_async().get()
+		try:
+			while True:
+				text, isFinal = self.events.get()
+				yield text, isFinal
+				if isFinal:
+					return
+		finally:
+			self.speech_recognizer.stop_continuous_recognition_async() # Don't wait for it, the move can be played meanwhile
+
+class ReplayRecognizer(Recognizer):
+	# Stand-in for testing without a microphone: replays utterances from a text file, one per line, a word at a time
+	# Blank lines and lines starting with # are skipped. Raises EOFError once every utterance has been replayed, like input()
+	def __init__(self, path, wordSeconds=0.0):
+		with open(path) as f:
+			self.utterances = [line.strip() for line in f if line.strip() != "" and not line.startswith("#")]
+		self.wordSeconds = wordSeconds # Time taken to say each word
+
+	def listen(self):
+		if len(self.utterances) == 0:
+			raise EOFError("No more utterances to replay")
+
+		words = self.utterances.pop(0).split()
+		for i in range(1, len(words) + 1):
+			time.sleep(self.wordSeconds)
+			yield " ".join(words[:i]), i == len(words)
+
+def stream_move(chess_algorithm, recognizer):
+	# Listens to one utterance and returns the parsed move, ready for chess_algorithm.play_parsed_move()
+	parsed = create_string_buffer(16)
+	chess_algorithm.begin_utterance()
+
+	hypotheses = recognizer.listen()
+	try:
+		for text, isFinal in hypotheses:
+			heard = create_string_buffer(text[:1000].encode(), 1024)
+			if chess_algorithm.understand_partial(parsed, heard): # Only one legal move left, no need to wait for the rest
+				print("Heard enough: ", text)
+				break
+			if isFinal:
+				print("You said: ", text)
+				chess_algorithm.understand(parsed, heard)
+				break
+	finally:
+		hypotheses.close()
+	return parsed
@@ -0,0 +1,203 @@
+from ctypes import *
+from collections import Counter
+import multiprocessing
+import os
+import random
+import sys
+import time
+
+# Self-play stress test for the whole move pipeline, without anyone talking to the board.
+# Games are generated move by move and spoken to the library as text (as the recognizer would hand it over),
+# so every move goes through understanding, validation, the motion planner and the command queue, which is then drained
+# as control.py does. Games run in parallel, one library per worker process.
+#     python3 selfplay.py GAMES [random|greedy] [WORKERS] [MAX_PLIES]
+# "greedy" takes the most valuable capture it can (or promotes), and plays endgames from the tablebases if they're there.
+
+so_file = "chess_algorithm.so"
+
+TABLEBASE_DIRECTORY = b"tablebases"
+MAX_CANDIDATES = 256 # Same as in chess_algorithm.c
+DEFAULT_MAX_PLIES = 300
+MAX_RETRIES = 8 # Other moves tried when the planner can't carry one out, before the game is given up as stuck
+SHORT_FORM_CHANCE = 0.5 # How often an unambiguous move is spoken by its destination only ("knight falafel 3")
+
+# Plan statuses (see PLAN_* in chess_algorithm.c)
+PLAN_FAILURES = {1: "no exit", 2: "no route", 3: "queue full"}
+COMMAND_TYPES = ["magnet", "file", "rank", "both", "park"]
+
+PIECE_WORDS = {"p": "pawn", "n": "knight", "b": "bishop", "r": "rook", "q": "queen", "k": "king"}
+FILE_CODES = ["apple", "banana", "cash", "donut", "eggplant", "falafel", "garlic", "hazelnut"]
+PIECE_VALUES = {"p": 1, "n": 3, "b": 3, "r": 5, "q": 9, "k": 0, ".": 0}
+
+chess_algorithm = None # Loaded once per worker process
+
+def load_library():
+	global chess_algorithm
+	devnull = os.open(os.devnull, os.O_WRONLY)
+	os.dup2(devnull, 1) # The library prints every move and board, only the parent's report is wanted
+	chess_algorithm = CDLL(os.path.abspath(so_file))
+	chess_algorithm.run_chess_algorithm.argtypes = c_char_p,
+	chess_algorithm.get_int_command_value.restype = c_int32
+	chess_algorithm.get_float_command_value_b.restype = c_float
+	chess_algorithm.get_tts.restype = c_char_p
+	chess_algorithm.has_tts.restype = c_bool
+	chess_algorithm.is_running.restype = c_bool
+	chess_algorithm.has_commands.restype = c_bool
+	chess_algorithm.get_square.restype = c_char
+	chess_algorithm.tablebase_open.argtypes = c_char_p,
+	chess_algorithm.tablebase_open.restype = c_bool
+	chess_algorithm.tablebase_best_move.restype = c_bool
+	chess_algorithm.get_plan_cache_hits.restype = c_longlong
+	chess_algorithm.get_plan_cache_misses.restype = c_longlong
+	chess_algorithm.set_debug_logging(False)
+	chess_algorithm.tablebase_open(TABLEBASE_DIRECTORY)
+
+def legal_moves():
+	buffer = create_string_buffer(MAX_CANDIDATES * 6)
+	count = chess_algorithm.generate_legal_moves(chess_algorithm.get_turn(), buffer)
+	return [buffer.raw[6 * i:6 * i + 6].split(b"\0")[0].decode() for i in range(count)]
+
+def square(move, offset):
+	return chess_algorithm.get_square(int(move[offset + 1]) - 1, ord(move[offset]) - ord("a")).decode()
+
+def is_promotion(move):
+	return move[0] == "p" and move[4] in "18"
+
+# Text the recognizer could have heard for a move
+def spoken(move, moves, rng, promotion=None):
+	if(move == "o-o"):
+		return "castle king side"
+	if(move == "o-o-o"):
+		return "castle queen side"
+	destination = "{} {}".format(FILE_CODES[ord(move[3]) - ord("a")], move[4])
+	sameDestination = [other for other in moves if other[0] == move[0] and other[3:] == move[3:]]
+	if(len(sameDestination) == 1 and rng.random() < SHORT_FORM_CHANCE):
+		text = "{} {}".format(PIECE_WORDS[move[0]], destination)
+	else:
+		text = "{} {} {} {}".format(PIECE_WORDS[move[0]], FILE_CODES[ord(move[1]) - ord("a")], move[2], destination)
+	if(promotion is not None):
+		text += " " + PIECE_WORDS[promotion]
+	return text
+
+# Picks the next move, and the piece to promote to if it's a promotion (None lets the library decide)
+def choose(moves, engine, rng):
+	if(engine == "greedy"):
+		best = create_string_buffer(8)
+		if(chess_algorithm.tablebase_best_move(best) and best.value.decode() in moves):
+			return best.value.decode(), None
+		scored = [(PIECE_VALUES[square(m, 3).lower()] + (8 if is_promotion(m) else 0) + rng.random() * 0.5 if m[0] != "o" else rng.random() * 0.5, m) for m in moves]
+		move = max(scored)[1]
+		return move, ("q" if is_promotion(move) else None)
+	move = rng.choice(moves)
+	return move, (rng.choice("qrbn") if move[0] != "o" and is_promotion(move) else None)
+
+# Empties the command queue like control.py; returns how many commands of each type the move took
+def drain_commands():
+	counts = [0] * len(COMMAND_TYPES)
+	while chess_algorithm.has_commands():
+		commandType = chess_algorithm.get_command_type()
+		counts[commandType] += 1
+		if(commandType == 0):
+			chess_algorithm.get_int_command_value()
+		else:
+			chess_algorithm.get_float_command_value_b()
+	return counts
+
+def drain_tts():
+	messages = []
+	while chess_algorithm.has_tts():
+		messages.append(chess_algorithm.get_tts().decode())
+	return messages
+
+def play_game(job):
+	game, seed, engine, maxPlies = job
+	if(chess_algorithm is None):
+		load_library()
+	rng = random.Random(seed * 1000003 + game)
+	stats = {"moves": 0, "seconds": 0.0, "latencies": [], "failures": Counter(), "misunderstood": 0, "commandsPerMove": Counter(),
+		"commandTypes": [0] * len(COMMAND_TYPES), "ending": "ply limit", "cacheHits": 0, "cacheLookups": 0}
+	hits, lookups = chess_algorithm.get_plan_cache_hits(), chess_algorithm.get_plan_cache_hits() + chess_algorithm.get_plan_cache_misses()
+
+	chess_algorithm.init_board()
+	drain_commands()
+	drain_tts()
+	for ply in range(maxPlies):
+		if(not chess_algorithm.is_running()):
+			stats["ending"] = "game over"
+			break
+		moves = legal_moves()
+		turn = chess_algorithm.get_turn()
+		for attempt in range(MAX_RETRIES + 1):
+			if(not moves):
+				break
+			move, promotion = choose(moves, engine, rng)
+			start = time.perf_counter()
+			chess_algorithm.run_chess_algorithm(create_string_buffer(spoken(move, moves, rng, promotion).encode(), 128))
+			seconds = time.perf_counter() - start
+			messages = drain_tts()
+			counts = drain_commands()
+
+			if(chess_algorithm.get_turn() != turn): # Accepted
+				stats["moves"] += 1
+				stats["seconds"] += seconds
+				stats["latencies"].append(seconds)
+				stats["commandsPerMove"][sum(counts)] += 1
+				stats["commandTypes"] = [a + b for a, b in zip(stats["commandTypes"], counts)]
+				break
+			if(any("can't find a way" in message for message in messages)):
+				stats["failures"][PLAN_FAILURES.get(chess_algorithm.get_plan_status(), "unknown")] += 1
+			else:
+				stats["misunderstood"] += 1
+			moves.remove(move) # Try something else
+		if(chess_algorithm.get_turn() == turn):
+			stats["ending"] = "stuck"
+			break
+
+	stats["cacheHits"] = chess_algorithm.get_plan_cache_hits() - hits
+	stats["cacheLookups"] = chess_algorithm.get_plan_cache_hits() + chess_algorithm.get_plan_cache_misses() - lookups
+	return stats
+
+def percentile(values, fraction):
+	return values[min(len(values) - 1, int(fraction * len(values)))] if values else 0
+
+def report(results, wallSeconds, workers):
+	moves = sum(r["moves"] for r in results)
+	latencies = sorted(l for r in results for l in r["latencies"])
+	failures = sum((r["failures"] for r in results), Counter())
+	commandsPerMove = sum((r["commandsPerMove"] for r in results), Counter())
+	commandTypes = [sum(r["commandTypes"][i] for r in results) for i in range(len(COMMAND_TYPES))]
+	endings = Counter(r["ending"] for r in results)
+	cacheHits = sum(r["cacheHits"] for r in results)
+	cacheLookups = sum(r["cacheLookups"] for r in results)
+
+	print("{} games, {} moves in {:.1f}s on {} workers: {:.0f} moves/s ({:.0f} per worker)".format(len(results), moves, wallSeconds, workers,
+		moves / wallSeconds, moves / wallSeconds / workers))
+	print("Endings: " + ", ".join("{} {}".format(count, ending) for ending, count in endings.most_common()))
+	print("Move latency: p50 {:.2f}ms, p99 {:.2f}ms, max {:.2f}ms".format(1e3 * percentile(latencies, 0.5), 1e3 * percentile(latencies, 0.99),
+		1e3 * (latencies[-1] if latencies else 0)))
+	print("Planner failures: {} ({})".format(sum(failures.values()), ", ".join("{} {}".format(count, kind) for kind, count in failures.most_common()) or "none"))
+	print("Moves not understood: {}".format(sum(r["misunderstood"] for r in results)))
+	print("Plan cache: {:.1f}% hits".format(100 * cacheHits / max(1, cacheLookups)))
+	print("Commands: " + ", ".join("{} {}".format(count, name) for name, count in zip(COMMAND_TYPES, commandTypes)))
+
+	print("Commands per move:")
+	largest = max(commandsPerMove.values(), default=1)
+	for count in sorted(commandsPerMove):
+		print("{:>5} {:>8} {:>6.2f}% {}".format(count, commandsPerMove[count], 100 * commandsPerMove[count] / max(1, moves),
+			"#" * max(1, round(40 * commandsPerMove[count] / largest))))
+
+if __name__ == '__main__':
+	if(len(sys.argv) < 2 or (len(sys.argv) > 2 and sys.argv[2] not in ("random", "greedy"))):
+		print("Usage: python3 selfplay.py GAMES [random|greedy] [WORKERS] [MAX_PLIES]")
+		sys.exit(2)
+	games = int(sys.argv[1])
+	engine = sys.argv[2] if len(sys.argv) > 2 else "random"
+	workers = int(sys.argv[3]) if len(sys.argv) > 3 else os.cpu_count()
+	maxPlies = int(sys.argv[4]) if len(sys.argv) > 4 else DEFAULT_MAX_PLIES
+	seed = int(time.time())
+
+	print("Playing {} {} games (seed {})".format(games, engine, seed))
+	start = time.perf_counter()
+	with multiprocessing.Pool(workers) as pool:
+		results = list(pool.imap_unordered(play_game, [(game, seed, engine, maxPlies) for game in range(games)]))
+	report(results, time.perf_counter() - start, workers)
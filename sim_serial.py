@@ -0,0 +1,132 @@
+import os
+import pty
+import select
+import sys
+import threading
+import time
+import tty
+from motion import MOTOR_X_STEP, MOTOR_Y_STEP, MOTOR_Z_STEP, MOTOR_X_DIR, MOTOR_Y_DIR, MOTOR_Z_DIR, ELECTROMAGNET, UNIT_STEP
+
+# Simulated Arduinos, for running the controllers without hardware.
+# Each rig is a pty pair: the controller opens the slave end (rig.path) as if it were the Arduino's serial port,
+# and the rig decodes the Firmata messages written to it, tracking the carriage position and magnet state.
+#     python3 sim_serial.py [number_of_rigs]
+
+# Firmata commands (only what the controllers send is decoded, the rest is skipped over)
+DIGITAL_MESSAGE = 0x90
+ANALOG_MESSAGE = 0xE0
+REPORT_ANALOG = 0xC0
+REPORT_DIGITAL = 0xD0
+SET_PIN_MODE = 0xF4
+PROTOCOL_VERSION = 0xF9
+START_SYSEX = 0xF0
+END_SYSEX = 0xF7
+SYSTEM_RESET = 0xFF
+
+# Number of data bytes following each command
+DATA_BYTES = {DIGITAL_MESSAGE: 2, ANALOG_MESSAGE: 2, REPORT_ANALOG: 1, REPORT_DIGITAL: 1, SET_PIN_MODE: 2, PROTOCOL_VERSION: 2, SYSTEM_RESET: 0}
+
+class SimulatedRig:
+	def __init__(self, name):
+		self.name = name
+		self.master, self.slave = pty.openpty()
+		tty.setraw(self.slave) # No echo or newline translation, bytes go through untouched
+		self.path = os.ttyname(self.slave) # The slave stays open so the pty survives the controller reconnecting
+
+		self.pins = {}
+		self.pinModes = {}
+		self.command = None # Firmata command being received, and its data bytes so far
+		self.data = []
+		self.sysex = False
+
+		self.filePos = 0 # In steps, see UNIT_STEP
+		self.rankPos = 0
+		self.magnet = 0 # Duty cycle, in [0, 1]
+		self.steps = 0
+		self.magnetToggles = 0
+		self.faults = 0 # Step pulses that don't make sense, e.g. the two file motors turning different ways
+		self.bytesReceived = 0
+		self.messages = 0
+		self.stopped = threading.Event()
+
+	def feed(self, data):
+		self.bytesReceived += len(data)
+		for byte in data:
+			if(self.sysex):
+				self.sysex = byte != END_SYSEX
+			elif(byte == START_SYSEX):
+				self.sysex = True
+			elif(byte & 0x80): # Start of a command, anything unfinished is dropped
+				self.command = byte & 0xF0 if byte < 0xF0 else byte
+				self.channel = byte & 0x0F
+				self.data = []
+				self.finish_command()
+			elif(self.command is not None):
+				self.data.append(byte)
+				self.finish_command()
+
+	def finish_command(self):
+		if(len(self.data) < DATA_BYTES.get(self.command, 0)):
+			return
+
+		self.messages += 1
+		if(self.command == DIGITAL_MESSAGE): # Whole port at once, 8 pins per port
+			state = self.data[0] | (self.data[1] << 7)
+			for bit in range(8):
+				self.set_pin(self.channel * 8 + bit, (state >> bit) & 1)
+		elif(self.command == ANALOG_MESSAGE and self.channel == ELECTROMAGNET): # PWM duty cycle, out of 255
+			duty = (self.data[0] | (self.data[1] << 7)) / 255
+			if((duty > 0) != (self.magnet > 0)):
+				self.magnetToggles += 1
+			self.magnet = duty
+		elif(self.command == SET_PIN_MODE):
+			self.pinModes[self.data[0]] = self.data[1]
+		self.command = None
+
+	def set_pin(self, pin, value):
+		previous = self.pins.get(pin, 0)
+		self.pins[pin] = value
+		if(value == previous):
+			return
+
+		if(value == 1 and pin == MOTOR_X_STEP): # File motors, Z mirrors X and turns the other way
+			self.filePos += 1 if self.pins.get(MOTOR_X_DIR, 0) == 0 else -1
+			self.steps += 1
+		elif(value == 1 and pin == MOTOR_Z_STEP):
+			if(self.pins.get(MOTOR_Z_DIR, 0) == self.pins.get(MOTOR_X_DIR, 0) or self.pins.get(MOTOR_X_STEP, 0) != 1):
+				self.faults += 1
+		elif(value == 1 and pin == MOTOR_Y_STEP):
+			self.rankPos += 1 if self.pins.get(MOTOR_Y_DIR, 0) == 1 else -1
+			self.steps += 1
+
+	def run(self):
+		while not self.stopped.is_set():
+			readable, _, _ = select.select([self.master], [], [], 0.1)
+			if(readable):
+				try:
+					self.feed(os.read(self.master, 4096))
+				except OSError: # Controller went away
+					time.sleep(0.1)
+
+	def start(self):
+		threading.Thread(target=self.run, daemon=True).start()
+		return self
+
+	def stop(self):
+		self.stopped.set()
+
+	def status(self):
+		return "{}: {} at ({:.2f}, {:.2f}) tiles, magnet at {:.0f}%, {} steps, {} toggles, {} messages, {} faults".format(self.name, self.path,
+			self.filePos / UNIT_STEP, self.rankPos / UNIT_STEP, 100 * self.magnet, self.steps, self.magnetToggles, self.messages, self.faults)
+
+if __name__ == '__main__':
+	rigs = [SimulatedRig("rig {}".format(i)).start() for i in range(int(sys.argv[1]) if len(sys.argv) > 1 else 1)]
+	for rig in rigs:
+		print("{} listening on {}".format(rig.name, rig.path))
+	try:
+		while True:
+			time.sleep(1)
+			for rig in rigs:
+				print(rig.status())
+	except KeyboardInterrupt:
+		pass
@@ -0,0 +1,104 @@
+from ctypes import *
+import sys
+import time
+from multiprocessing import resource_tracker, shared_memory
+
+# Reads the live game snapshot that chess_algorithm.c publishes in shared memory (see open_snapshot_channel()).
+# Readers never block the control loop: the library bumps a sequence number around every write (a seqlock), and the
+# reader simply retries if the number was odd or changed while it was copying.
+#     python3 snapshot_reader.py [/chessboard] [--watch]
+
+SNAPSHOT_MAGIC = 0x43485353
+SNAPSHOT_VERSION = 1
+BOARD_SIZE = 10 # Must match chess_algorithm.c
+COMMAND_QUEUE_SIZE = 256
+
+COMMAND_NAMES = ["magnet", "row", "col", "both", "park"]
+STATUS_NAMES = {-1: "", 0: "check", 1: "checkmate", 2: "stalemate"}
+
+class Command(Structure):
+	_fields_ = [("commandType", c_int32), ("i1", c_int32), ("f1", c_float), ("f2", c_float)]
+
+class Snapshot(Structure):
+	_fields_ = [
+		("magic", c_uint32),
+		("version", c_uint32),
+		("size", c_uint32),
+		("sequence", c_uint32),
+		("turn", c_int32),
+		("status", c_int32),
+		("running", c_int32),
+		("magnetOn", c_int32),
+		("carriageRow", c_float),
+		("carriageCol", c_float),
+		("plannedRow", c_float),
+		("plannedCol", c_float),
+		("numCommands", c_int32),
+		("commands", Command * COMMAND_QUEUE_SIZE),
+		("board", (c_char * BOARD_SIZE) * BOARD_SIZE),
+	]
+
+class SnapshotReader:
+	def __init__(self, name="/chessboard"):
+		try:
+			self.segment = shared_memory.SharedMemory(name=name.lstrip("/"), track=False)
+		except TypeError: # Before Python 3.13, attaching registers the segment for removal when this process exits
+			self.segment = shared_memory.SharedMemory(name=name.lstrip("/"))
+			resource_tracker.unregister(self.segment._name, "shared_memory")
+
+		self.view = Snapshot.from_buffer(self.segment.buf) # Zero-copy view of the live segment
+		if self.view.magic != SNAPSHOT_MAGIC or self.view.version != SNAPSHOT_VERSION or self.view.size != sizeof(Snapshot):
+			raise ValueError("Unrecognized snapshot layout (version {}, {} bytes)".format(self.view.version, self.view.size))
+
+	def sequence(self):
+		return self.view.sequence
+
+	# Returns a consistent copy of the snapshot, as a dict
+	def read(self):
+		while True:
+			before = self.view.sequence
+			if before % 2 == 1: # Writer is busy
+				continue
+
+			state = {
+				"sequence": before,
+				"turn": "white" if self.view.turn == 0 else "black",
+				"status": STATUS_NAMES.get(self.view.status, ""),
+				"running": bool(self.view.running),
+				"magnet": bool(self.view.magnetOn),
+				"carriage": (self.view.carriageRow, self.view.carriageCol),
+				"planned": (self.view.plannedRow, self.view.plannedCol),
+				"commands": [(COMMAND_NAMES[c.commandType], c.i1, c.f1, c.f2) for c in self.view.commands[:max(0, min(self.view.numCommands, COMMAND_QUEUE_SIZE))]],
+				"board": [bytes(row).decode() for row in self.view.board],
+			}
+			if self.view.sequence == before:
+				return state
+
+	def close(self):
+		del self.view # The buffer can't be released while a view of it exists
+		self.segment.close()
+
+def print_state(state):
+	print("turn: {}  {}  magnet: {}  carriage: ({:.2f}, {:.2f})  pending commands: {}".format(state["turn"], state["status"],
+		"on" if state["magnet"] else "off", state["carriage"][0], state["carriage"][1], len(state["commands"])))
+	for row in reversed(state["board"]): # Rank 8 at the top, like print_board()
+		print("    " + " ".join(row))
+
+if __name__ == '__main__':
+	args = [arg for arg in sys.argv[1:] if not arg.startswith("--")]
+	reader = SnapshotReader(args[0] if args else "/chessboard")
+	try:
+		if "--watch" not in sys.argv:
+			print_state(reader.read())
+		else:
+			lastSequence = None
+			while True:
+				if reader.sequence() != lastSequence:
+					state = reader.read()
+					lastSequence = state["sequence"]
+					print_state(state)
+				time.sleep(0.05)
+	except KeyboardInterrupt:
+		pass
+	finally:
+		reader.close()
@@ -0,0 +1,418 @@
+// Retrograde generator for the endgame tablebases that chess_algorithm.c looks up (see DECLARATIONS FOR ENDGAME TABLEBASES)
+// Build and run from the repository root:
+//     gcc -O2 -o tablebase_gen tablebase_gen.c -lm
+//     ./tablebase_gen tablebases KQK KRK KPK KBNK KQKR
+// Signatures list white's pieces, then black's, each starting with the king (at most TB_MAX_PIECES pieces in total).
+// Every table a signature converts into by a capture or a promotion is generated first, down to KK; tables already on disk are reused.
+// Castling and en passant are left out, as they are by the lookups.
+
+#include "chess_algorithm.c"
+
+const int UNRESOLVED = 127; // Value of a position that hasn't been solved (yet), TB_UNKNOWN is never stored
+const int MAX_PLIES = 126;
+#define MAX_CHILDREN 128
+
+char outputDirectory [256];
+
+// Layout of a table: which piece goes with each square in the index (see tablebase_index())
+struct layout {
+    char signature [TB_MAX_PIECES + 1];
+    int numPieces;
+    int pieceIds [TB_MAX_PIECES];
+    int colours [TB_MAX_PIECES];
+};
+
+// Parses a signature such as "KBNK", putting it in canonical form (white the stronger side); returns false if it isn't valid
+bool parse_signature(char *text, struct layout *layout) {
+    struct tb_piece pieces [TB_MAX_PIECES];
+    int numPieces = 0, numKings = 0;
+    for(char *c = text; *c != '\0'; c++) {
+        const struct piece *p = piece_from_fen(*c); // Uppercase, so white
+        if(p == NULL || numPieces == TB_MAX_PIECES) return false;
+        if(p->pieceId == KING_ID) numKings++;
+        else if(numKings == 0) return false; // Every side starts with its king
+        struct tb_piece found = {p->pieceId, numKings == 1 ? WHITE : BLACK, numPieces};
+        pieces[numPieces++] = found;
+    }
+    if(numKings != 2) return false;
+
+    tablebase_canonical(pieces, numPieces, WHITE);
+    tablebase_signature(pieces, numPieces, layout->signature);
+    layout->numPieces = numPieces;
+    for(int i = 0; i < numPieces; i++) {
+        layout->pieceIds[i] = pieces[i].pieceId;
+        layout->colours[i] = pieces[i].colour;
+    }
+    return true;
+}
+
+void decode_index(struct layout *layout, uint64_t index, struct tb_piece *pieces, int *toMove) {
+    for(int i = layout->numPieces - 1; i >= 0; i--) {
+        pieces[i].pieceId = layout->pieceIds[i];
+        pieces[i].colour = layout->colours[i];
+        if(i > 0) {
+            pieces[i].square = index % 64;
+            index /= 64;
+        }
+    }
+    pieces[0].square = (index % 32 / 4) * 8 + index % 4;
+    *toMove = index / 32;
+}
+
+uint64_t occupancy(struct tb_piece *pieces, int numPieces) {
+    uint64_t occupied = 0;
+    for(int i = 0; i < numPieces; i++) occupied |= 1ULL << pieces[i].square;
+    return occupied;
+}
+
+// Whether any piece of the given colour attacks the square
+bool gen_attacked(struct tb_piece *pieces, int numPieces, int square, int byColour) {
+    uint64_t occupied = occupancy(pieces, numPieces);
+    for(int i = 0; i < numPieces; i++) {
+        struct tb_piece *p = &pieces[i];
+        if(p->colour != byColour) continue;
+
+        if(p->pieceId == KING_ID && (kingSources[p->square] >> square & 1)) return true;
+        if(p->pieceId == KNIGHT_ID && (knightSources[p->square] >> square & 1)) return true;
+        if(p->pieceId == PAWN_ID) {
+            if(square / 8 == p->square / 8 + (byColour == WHITE ? 1 : -1) && abs(square % 8 - p->square % 8) == 1) return true;
+        } else if(p->pieceId == QUEEN_ID || p->pieceId == ROOK_ID || p->pieceId == BISHOP_ID) {
+            for(int direction = (p->pieceId == BISHOP_ID ? 4 : 0); direction < (p->pieceId == ROOK_ID ? 4 : 8); direction++) {
+                for(int j = 0; j < rayLength[p->square][direction]; j++) {
+                    int s = raySquares[p->square][direction][j];
+                    if(s == square) return true;
+                    if(occupied >> s & 1) break;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+bool king_attacked(struct tb_piece *pieces, int numPieces, int colour) {
+    for(int i = 0; i < numPieces; i++) {
+        if(pieces[i].pieceId == KING_ID && pieces[i].colour == colour) return gen_attacked(pieces, numPieces, pieces[i].square, 1 - colour);
+    }
+    return false;
+}
+
+// Whether an index stands for a position that can come up, and is the one canonical form of it
+bool position_valid(struct tb_piece *pieces, int numPieces, int toMove) {
+    if(__builtin_popcountll(occupancy(pieces, numPieces)) != numPieces) return false; // Two pieces on one square
+    for(int i = 0; i < numPieces; i++) {
+        if(pieces[i].pieceId == PAWN_ID && (pieces[i].square / 8 == 0 || pieces[i].square / 8 == 7)) return false;
+        if(i > 0 && pieces[i].pieceId == pieces[i - 1].pieceId && pieces[i].colour == pieces[i - 1].colour && pieces[i].square < pieces[i - 1].square) return false;
+    }
+    return !king_attacked(pieces, numPieces, 1 - toMove); // The player who just moved can't have left their king in check
+}
+
+// A position reached by a move; "converts" if the move was a capture or promotion, which leads into another table
+struct child {
+    struct tb_piece pieces [TB_MAX_PIECES];
+    int numPieces;
+    bool converts;
+};
+
+// Adds the move of piece "mover" to "dest" (with "promoteTo" if not -1), if it doesn't leave the mover's own king in check
+void add_child(struct tb_piece *pieces, int numPieces, int mover, int dest, int promoteTo, struct child *children, int *numChildren) {
+    struct child *c = &children[*numChildren];
+    c->numPieces = 0;
+    c->converts = promoteTo != -1;
+    for(int i = 0; i < numPieces; i++) {
+        if(pieces[i].square == dest) {
+            c->converts = true; // Captured
+            continue;
+        }
+        c->pieces[c->numPieces] = pieces[i];
+        if(i == mover) {
+            c->pieces[c->numPieces].square = dest;
+            if(promoteTo != -1) c->pieces[c->numPieces].pieceId = promoteTo;
+        }
+        c->numPieces++;
+    }
+    if(!king_attacked(c->pieces, c->numPieces, pieces[mover].colour)) (*numChildren)++;
+}
+
+// Every legal move for the player to move; returns how many there are
+int generate_children(struct tb_piece *pieces, int numPieces, int toMove, struct child *children) {
+    uint64_t occupied = occupancy(pieces, numPieces), own = 0;
+    for(int i = 0; i < numPieces; i++) {
+        if(pieces[i].colour == toMove) own |= 1ULL << pieces[i].square;
+    }
+
+    int numChildren = 0;
+    for(int i = 0; i < numPieces; i++) {
+        struct tb_piece *p = &pieces[i];
+        if(p->colour != toMove) continue;
+
+        if(p->pieceId == KING_ID || p->pieceId == KNIGHT_ID) {
+            for(uint64_t to = (p->pieceId == KING_ID ? kingSources[p->square] : knightSources[p->square]) & ~own; to != 0; to &= to - 1) {
+                add_child(pieces, numPieces, i, __builtin_ctzll(to), -1, children, &numChildren);
+            }
+        } else if(p->pieceId == PAWN_ID) {
+            int forward = (toMove == WHITE ? 8 : -8);
+            int dests [4], numDests = 0;
+            if(!(occupied >> (p->square + forward) & 1)) {
+                dests[numDests++] = p->square + forward;
+                int startRank = (toMove == WHITE ? 1 : 6);
+                if(p->square / 8 == startRank && !(occupied >> (p->square + 2 * forward) & 1)) dests[numDests++] = p->square + 2 * forward;
+            }
+            for(int side = -1; side <= 1; side += 2) {
+                int file = p->square % 8 + side, dest = p->square + forward + side;
+                if(file >= 0 && file < 8 && (occupied & ~own) >> dest & 1) dests[numDests++] = dest;
+            }
+            for(int j = 0; j < numDests; j++) {
+                if(dests[j] / 8 == 0 || dests[j] / 8 == 7) {
+                    const int promotions [4] = {QUEEN_ID, ROOK_ID, BISHOP_ID, KNIGHT_ID};
+                    for(int k = 0; k < 4; k++) add_child(pieces, numPieces, i, dests[j], promotions[k], children, &numChildren);
+                } else add_child(pieces, numPieces, i, dests[j], -1, children, &numChildren);
+            }
+        } else {
+            for(int direction = (p->pieceId == BISHOP_ID ? 4 : 0); direction < (p->pieceId == ROOK_ID ? 4 : 8); direction++) {
+                for(int j = 0; j < rayLength[p->square][direction]; j++) {
+                    int s = raySquares[p->square][direction][j];
+                    if(own >> s & 1) break;
+                    add_child(pieces, numPieces, i, s, -1, children, &numChildren);
+                    if(occupied >> s & 1) break; // Capture
+                }
+            }
+        }
+    }
+    return numChildren;
+}
+
+// Every position within the same table that could have come right before this one (by a move that isn't a capture or promotion)
+// Parents are written in canonical form; returns how many there are
+int generate_parents(struct tb_piece *pieces, int numPieces, int toMove, struct tb_piece parents [][TB_MAX_PIECES], int *parentToMove) {
+    uint64_t occupied = occupancy(pieces, numPieces);
+    int mover = 1 - toMove;
+    int numParents = 0;
+
+    for(int i = 0; i < numPieces; i++) {
+        struct tb_piece *p = &pieces[i];
+        if(p->colour != mover) continue;
+
+        int froms [32], numFroms = 0;
+        if(p->pieceId == KING_ID || p->pieceId == KNIGHT_ID) {
+            for(uint64_t from = (p->pieceId == KING_ID ? kingSources[p->square] : knightSources[p->square]) & ~occupied; from != 0; from &= from - 1) froms[numFroms++] = __builtin_ctzll(from);
+        } else if(p->pieceId == PAWN_ID) {
+            int back = (mover == WHITE ? -8 : 8);
+            int from = p->square + back;
+            if(from / 8 >= 1 && from / 8 <= 6 && !(occupied >> from & 1)) {
+                froms[numFroms++] = from;
+                int doubleRank = (mover == WHITE ? 3 : 4); // Rank a double advance ends on
+                if(p->square / 8 == doubleRank && !(occupied >> (from + back) & 1)) froms[numFroms++] = from + back;
+            }
+        } else {
+            for(int direction = (p->pieceId == BISHOP_ID ? 4 : 0); direction < (p->pieceId == ROOK_ID ? 4 : 8); direction++) {
+                for(int j = 0; j < rayLength[p->square][direction] && !(occupied >> raySquares[p->square][direction][j] & 1); j++) froms[numFroms++] = raySquares[p->square][direction][j];
+            }
+        }
+
+        for(int j = 0; j < numFroms; j++) {
+            struct tb_piece *parent = parents[numParents];
+            memcpy(parent, pieces, numPieces * sizeof(struct tb_piece));
+            parent[i].square = froms[j];
+            if(king_attacked(parent, numPieces, toMove)) continue; // The player to move now couldn't have been in check then
+            parentToMove[numParents] = tablebase_canonical(parent, numPieces, mover);
+            numParents++;
+        }
+    }
+    return numParents;
+}
+
+// Whether a table for the signature is already on disk
+bool table_on_disk(char *signature) {
+    char path [300];
+    snprintf(path, sizeof(path), "%s/%s.tb", outputDirectory, signature);
+    FILE *file = fopen(path, "rb");
+    if(file == NULL) return false;
+
+    struct tablebase_header header;
+    bool valid = fread(&header, sizeof(header), 1, file) == 1 && !memcmp(header.magic, TB_MAGIC, 8) && !strcmp(header.signature, signature);
+    long size = fseek(file, 0, SEEK_END) == 0 ? ftell(file) : -1;
+    valid = valid && size != -1 && (uint64_t) size == sizeof(header) + tablebase_entries(strlen(signature));
+    fclose(file);
+    return valid;
+}
+
+bool write_table(struct layout *layout, int8_t *values, uint64_t numEntries) {
+    char path [300];
+    snprintf(path, sizeof(path), "%s/%s.tb", outputDirectory, layout->signature);
+    FILE *file = fopen(path, "wb");
+    if(file == NULL) return false;
+
+    struct tablebase_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TB_MAGIC, 8);
+    strcpy(header.signature, layout->signature);
+    header.numPieces = layout->numPieces;
+    header.numEntries = numEntries;
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1 && fwrite(values, 1, numEntries, file) == numEntries;
+    return fclose(file) == 0 && written;
+}
+
+bool generate_table(char *signature);
+
+// Generates every table a move out of this one can lead into
+bool generate_successors(struct layout *layout) {
+    for(int i = 0; i < layout->numPieces; i++) {
+        if(layout->pieceIds[i] == KING_ID) continue;
+
+        int numVariants = (layout->pieceIds[i] == PAWN_ID ? 5 : 1); // Captured, or promoted to each piece
+        const int promotions [4] = {QUEEN_ID, ROOK_ID, BISHOP_ID, KNIGHT_ID};
+        for(int v = 0; v < numVariants; v++) {
+            char successor [TB_MAX_PIECES + 1];
+            int length = 0;
+            const char letters [6] = {'P', 'N', 'B', 'R', 'Q', 'K'};
+            for(int j = 0; j < layout->numPieces; j++) {
+                if(j != i) successor[length++] = letters[layout->pieceIds[j]];
+                else if(v > 0) successor[length++] = letters[promotions[v - 1]];
+            }
+            successor[length] = '\0';
+            if(!generate_table(successor)) return false;
+        }
+    }
+    return true;
+}
+
+// Solves one table by retrograde analysis and writes it out
+// First every position is scored from the moves that leave the table (whose results are already known), then results are spread
+// backwards one ply at a time: a position one move away from a lost position is won, and a position whose every move leads to a
+// won position is lost. Whatever is never reached is a draw.
+// values, movesLeft and slowestExit have an entry per position, see solve()
+bool solve_table(struct layout *layout, int8_t *values, uint8_t *movesLeft, int8_t *slowestExit) {
+    uint64_t numEntries = tablebase_entries(layout->numPieces);
+    struct child children [MAX_CHILDREN];
+    struct tb_piece pieces [TB_MAX_PIECES];
+    int toMove;
+    int deepest = 0; // Longest mate assigned so far, in plies; every ply up to it has to be spread backwards
+    long long start = trace_now();
+
+    for(uint64_t index = 0; index < numEntries; index++) {
+        decode_index(layout, index, pieces, &toMove);
+        if(!position_valid(pieces, layout->numPieces, toMove)) {
+            values[index] = TB_ILLEGAL;
+            continue;
+        }
+
+        int numChildren = generate_children(pieces, layout->numPieces, toMove, children);
+        int numInside = 0, fastestWin = MAX_PLIES + 1, slowestLoss = -1;
+        bool drawExit = false;
+        for(int i = 0; i < numChildren; i++) {
+            if(!children[i].converts) {
+                numInside++;
+                continue;
+            }
+            int value = tablebase_probe_pieces(children[i].pieces, children[i].numPieces, 1 - toMove);
+            if(!tablebase_is_result(value)) {
+                printf("[TABLEBASE] Missing a result for a move out of %s\n", layout->signature);
+                return false;
+            }
+            if(value < 0 && tablebase_plies(value) + 1 < fastestWin) fastestWin = tablebase_plies(value) + 1;
+            else if(value == TB_DRAW) drawExit = true;
+            else if(value > 0 && tablebase_plies(value) + 1 > slowestLoss) slowestLoss = tablebase_plies(value) + 1;
+        }
+
+        movesLeft[index] = numInside + drawExit; // A draw on the way out means this can never be lost
+        slowestExit[index] = slowestLoss;
+        if(numChildren == 0) values[index] = king_attacked(pieces, layout->numPieces, toMove) ? -1 : TB_DRAW;
+        else if(fastestWin <= MAX_PLIES) values[index] = fastestWin; // Might still be beaten by a quicker win inside the table
+        else if(numInside == 0) values[index] = drawExit ? TB_DRAW : -slowestLoss - 1;
+        else values[index] = UNRESOLVED;
+        if(values[index] != UNRESOLVED && values[index] != TB_DRAW && tablebase_plies(values[index]) > deepest) deepest = tablebase_plies(values[index]);
+    }
+
+    struct tb_piece parents [MAX_CHILDREN][TB_MAX_PIECES];
+    int parentToMove [MAX_CHILDREN];
+    for(int ply = 0; ply <= deepest; ply++) {
+        for(uint64_t index = 0; index < numEntries; index++) {
+            bool lost = values[index] == -ply - 1;
+            if(!lost && (ply == 0 || values[index] != ply)) continue;
+            if(ply == MAX_PLIES) {
+                printf("[TABLEBASE] %s has mates longer than %d plies\n", layout->signature, MAX_PLIES);
+                return false;
+            }
+
+            decode_index(layout, index, pieces, &toMove);
+            int numParents = generate_parents(pieces, layout->numPieces, toMove, parents, parentToMove);
+            for(int i = 0; i < numParents; i++) {
+                uint64_t parent = tablebase_index(parents[i], layout->numPieces, parentToMove[i]);
+                int value = values[parent];
+                int plies = ply + 1;
+                if(lost) {
+                    if(value == UNRESOLVED || (value > 0 && value > plies)) values[parent] = plies;
+                    else continue;
+                } else if(value == UNRESOLVED && --movesLeft[parent] == 0) {
+                    if(slowestExit[parent] > plies) plies = slowestExit[parent];
+                    values[parent] = -plies - 1;
+                } else continue;
+                if(plies > deepest) deepest = plies;
+            }
+        }
+    }
+
+    uint64_t wins = 0, losses = 0, draws = 0;
+    int longest = 0;
+    for(uint64_t index = 0; index < numEntries; index++) {
+        if(values[index] == UNRESOLVED) values[index] = TB_DRAW;
+        if(values[index] == TB_ILLEGAL) continue;
+        if(values[index] > 0) wins++;
+        else if(values[index] < 0) losses++;
+        else draws++;
+        if(values[index] != TB_DRAW && tablebase_plies(values[index]) > longest) longest = tablebase_plies(values[index]);
+    }
+    printf("[TABLEBASE] %s: %llu wins, %llu losses, %llu draws, longest mate %d plies (%.1f s)\n", layout->signature, (unsigned long long) wins,
+        (unsigned long long) losses, (unsigned long long) draws, longest, (trace_now() - start) / 1e9);
+
+    bool written = write_table(layout, values, numEntries);
+    if(!written) printf("[TABLEBASE] Couldn't write %s/%s.tb\n", outputDirectory, layout->signature);
+    return written;
+}
+
+// Sets up the working arrays for solve_table()
+bool solve(struct layout *layout) {
+    uint64_t numEntries = tablebase_entries(layout->numPieces);
+    int8_t *values = malloc(numEntries);
+    uint8_t *movesLeft = malloc(numEntries); // Moves that haven't been shown to lose yet
+    int8_t *slowestExit = malloc(numEntries); // Longest a loss through a capture or promotion takes, in plies (-1 if none)
+    bool solved = false;
+    if(values == NULL || movesLeft == NULL || slowestExit == NULL) printf("[TABLEBASE] Out of memory for %s\n", layout->signature);
+    else solved = solve_table(layout, values, movesLeft, slowestExit);
+
+    free(values); // Whichever way it went
+    free(movesLeft);
+    free(slowestExit);
+    return solved;
+}
+
+bool generate_table(char *signature) {
+    struct layout layout;
+    if(!parse_signature(signature, &layout)) {
+        printf("[TABLEBASE] Not a valid signature: %s\n", signature);
+        return false;
+    }
+    if(table_on_disk(layout.signature)) return true;
+    if(!generate_successors(&layout)) return false;
+
+    tablebase_open(outputDirectory); // Forget any lookups made before the successors were written
+    return solve(&layout);
+}
+
+int main(int argc, char **argv) {
+    if(argc < 3) {
+        printf("Usage: %s DIRECTORY SIGNATURE [SIGNATURE ...]\n", argv[0]);
+        return 2;
+    }
+    snprintf(outputDirectory, sizeof(outputDirectory), "%s", argv[1]);
+    if(access(outputDirectory, W_OK) != 0) {
+        printf("[TABLEBASE] Can't write to %s\n", outputDirectory);
+        return 1;
+    }
+    build_attack_tables();
+
+    for(int i = 2; i < argc; i++) {
+        if(!generate_table(argv[i])) return 1;
+    }
+    return 0;
+}
@@ -1,11 +1,12 @@
 from ctypes import *
-import azure.cognitiveservices.speech as speechsdk
 import ctypes
 import pyfirmata
+import sys
+import threading
 import time
-import pyttsx3
-
-engine = pyttsx3.init() # Initializes the speaker listening
+from motion import Motion, ELECTROMAGNET
+from narrator import Narrator
+from recognizer import AzureRecognizer, ReplayRecognizer, stream_move
 
 so_file = "chess_algorithm.so"
 
@@ -16,109 +17,110 @@ chess_algorithm.get_float_command_value_a.restype = c_float
 chess_algorithm.get_float_command_value_b.restype = c_float
 chess_algorithm.get_tts.restype = c_char_p
 chess_algorithm.is_running.restype = c_bool
+chess_algorithm.has_tts.restype = c_bool
+chess_algorithm.understand_partial.restype = c_bool
+chess_algorithm.trace_now.restype = c_longlong
+chess_algorithm.trace_record.argtypes = c_int, c_longlong, c_longlong
+chess_algorithm.trace_dump_chrome.argtypes = c_char_p,
+chess_algorithm.trace_dump_json_lines.argtypes = c_char_p,
+chess_algorithm.open_snapshot_channel.argtypes = c_char_p,
+chess_algorithm.open_snapshot_channel.restype = c_bool
+chess_algorithm.close_snapshot_channel.argtypes = c_char_p,
+chess_algorithm.tablebase_open.argtypes = c_char_p,
+chess_algorithm.tablebase_open.restype = c_bool
+chess_algorithm.archive_open.argtypes = c_char_p,
+chess_algorithm.archive_open.restype = c_bool
+
+# Stages recorded from this side of the library (see TRACE_* in chess_algorithm.c)
+TRACE_SPEECH = 0
+TRACE_TTS = 6 # Motor and magnet stages are recorded by motion.py
+TRACE_FILE = "chess_trace.json" # Open with chrome://tracing or ui.perfetto.dev
+QUIET_POLL_SECONDS = 0.05 # How often to check whether the announcements are done before listening
+SNAPSHOT_CHANNEL = b"/chessboard" # Live game state for spectators, see snapshot_reader.py
+TABLEBASE_DIRECTORY = b"tablebases" # Endgame tables, see tablebase_gen.c
+ARCHIVE_DIRECTORY = b"archive" # Every game played, searchable with archive_query.c
+
+def traced(stage, fn, *args):
+	start = chess_algorithm.trace_now()
+	result = fn(*args)
+	chess_algorithm.trace_record(stage, start, chess_algorithm.trace_now())
+	return result
+
+narrator = Narrator(chess_algorithm.trace_now) # Speaks on its own thread, so motors keep moving meanwhile
+
+# Hands the most important pending message over once the narrator is free (see queue_tts() in chess_algorithm.c)
+# The rest wait in the library's queue, where a later message can still overtake or replace them
+def narrate():
+	if(narrator.idle() and chess_algorithm.has_tts()):
+		narrator.say(chess_algorithm.get_tts().decode())
+	for start, end in narrator.finished_spans():
+		chess_algorithm.trace_record(TRACE_TTS, start, end)
+
+def dump_trace():
+	chess_algorithm.trace_dump_chrome(TRACE_FILE.encode())
+	chess_algorithm.trace_dump_json_lines((TRACE_FILE + "l").encode())
+	chess_algorithm.trace_print_histograms()
 
-def from_mic():
-	speech_config = speechsdk.SpeechConfig(subscription="f84602d441ba4ce6b6ff2aa108185ba9", region="eastus")
-	speech_recognizer = speechsdk.SpeechRecognizer(speech_config=speech_config)
-	result = speech_recognizer.recognize_once_async().get()
-	print("You said: ", result.text)
-	return result.text
+# Pass a transcript file to replay moves instead of listening to the microphone (see ReplayRecognizer)
+if len(sys.argv) > 1:
+	recognizer = ReplayRecognizer(sys.argv[1], wordSeconds=0.3)
+else:
+	recognizer = AzureRecognizer(subscription="f84602d441ba4ce6b6ff2aa108185ba9", region="eastus")
 
-def prompt_input(currentTurn):
+# Finishes parking the carriage (see park_carriage() in chess_algorithm.c) while the players think, until "stop" is set
+def keep_parking(stop):
+	while not stop.is_set():
+		delay = motion.idle_step()
+		if(delay is None):
+			return
+		if(delay > 0):
+			time.sleep(delay)
+
+def prompt_input():
+	stop = threading.Event()
+	parker = threading.Thread(target=keep_parking, args=(stop,), daemon=True) # Only touches the rig, so the library is free for the recognizer
+	parker.start()
+	while chess_algorithm.has_tts() or not narrator.idle(): # Let the announcements (including whose turn it is) finish first
+		narrate()
+		time.sleep(QUIET_POLL_SECONDS)
+	narrate() # Records their trace spans
 	if(chess_algorithm.is_running() == False): # No more input, game is done
 		print("Game over!")
-		quit()
+		quit() # Trace is dumped on the way out
 	print("It's white's turn:" if chess_algorithm.get_turn() == chess_algorithm.get_white() else "It's black's turn:")
-	if (chess_algorithm.get_turn() == chess_algorithm.get_white() and currentTurn != chess_algorithm.get_white()):
-		engine.say("It's white's turn") # Speaks it out loud
-		currentTurn = chess_algorithm.get_turn()
-		engine.runAndWait() # Runs it
-		time.sleep(0.5) # Waits so whatever is spoken here aloud isn't picked up by the speech-to-text mic
-	elif (chess_algorithm.get_turn() != chess_algorithm.get_white() and currentTurn == chess_algorithm.get_white()):
-		engine.say("It's black's turn")
-		currentTurn = chess_algorithm.get_turn()
-		engine.runAndWait() # Waits so whatever is spoken here aloud isn't picked up by the speech-to-text mic
-		time.sleep(0.5)
+	time.sleep(0.5) # Waits so whatever was spoken aloud isn't picked up by the speech-to-text mic
 	print("You may speak now.")
 
-	command = from_mic()
-	b_command = command.encode()
-
-	buf = create_string_buffer(1024)
-	buf.value = b_command
-	chess_algorithm.run_chess_algorithm(buf)
-	return currentTurn
+	parsed = traced(TRACE_SPEECH, stream_move, chess_algorithm, recognizer) # Returns as soon as the move is unambiguous
+	stop.set()
+	parker.join() # Whatever is left of the park is abandoned once the move is planned (see Motion.step())
+	chess_algorithm.play_parsed_move(parsed)
 
 if __name__ == '__main__':
 	board = pyfirmata.Arduino('/dev/cu.usbmodem141301')
 	print("Communication successfully started")
-	board.digital[8].write(0)
-
-	# Hardware pins (don't change!!)
-	motorXDir = 5
-	motorYDir = 6
-	motorZDir = 7
+	board.digital[ELECTROMAGNET].mode = pyfirmata.PWM
+	motion = Motion(chess_algorithm, lambda pin, value: board.digital[pin].write(value), lambda pin, duty: board.digital[pin].write(duty)) # Step generation, see motion.py
 
-	motorXStep = 2
-	motorYStep = 3
-	motorZStep = 4	
-	
-	electromagnet = 13
-
-	# Linear motion variables
-	# Tile A1 is the vertex of the sides with the motors
-	unitStep = 222 # Moves motor exactly 1 tile, with sleep time of 0.001 between turning on/off
-	targetFilePos = 0 # (0-2220)
-	targetRankPos = 0
-	targetMagnetState = 0
-	curFilePos = 0
-	curRankPos = 0
-	curMagnetState = 0
-
-	currentTurn = -1
+	if(not chess_algorithm.open_snapshot_channel(SNAPSHOT_CHANNEL)):
+		print("Couldn't open the snapshot channel, spectators won't see the game")
+	if(not chess_algorithm.tablebase_open(TABLEBASE_DIRECTORY)):
+		print("No endgame tablebases, endgames will be played out")
+	if(not chess_algorithm.archive_open(ARCHIVE_DIRECTORY)):
+		print("Couldn't open the game archive, this game won't be kept")
 	chess_algorithm.init_board()
 	chess_algorithm.print_board()
 
-	while True:
-		tts_message = chess_algorithm.get_tts().decode()
-		if(tts_message != ""):
-			engine.say(tts_message)
-			engine.runAndWait()
-			continue
-
-		board.digital[motorXDir].write(0 if curFilePos < targetFilePos else 1)
-		board.digital[motorYDir].write(1 if curRankPos < targetRankPos else 0)
-		board.digital[motorZDir].write(1 if curFilePos < targetFilePos else 0)
+	try:
+		while True:
+			narrate()
 
-		if(curFilePos == targetFilePos and curRankPos == targetRankPos and curMagnetState == targetMagnetState): #check for next command or prompt input
-			if(chess_algorithm.has_commands()): # Queue up next command
-				command_type = chess_algorithm.get_command_type()
-				if(command_type == 0): # Toggle magnet
-					targetMagnetState = chess_algorithm.get_int_command_value()
-				elif(command_type == 1): # Change file
-					targetFilePos = curFilePos + chess_algorithm.get_float_command_value_b() * unitStep
-				elif(command_type == 2): # Change rank
-					targetRankPos = curRankPos + chess_algorithm.get_float_command_value_b() * unitStep
-				elif(command_type == 3): # Change rank AND file
-					targetFilePos = round(curFilePos + chess_algorithm.get_float_command_value_a() * unitStep, 0)
-					targetRankPos = round(curRankPos + chess_algorithm.get_float_command_value_b() * unitStep, 0)
-			else: # Prompt input
-				currentTurn = prompt_input(currentTurn)
-		else: # Configure hardware to reach target states
-			if(targetMagnetState != curMagnetState): # Toggle magnet
-				curMagnetState = targetMagnetState
-				board.digital[electromagnet].write(curMagnetState)
-				time.sleep(2)
-			else: # Move motors
-				if(curFilePos != targetFilePos): # Move motors that control file
-					board.digital[motorXStep].write(1)
-					board.digital[motorZStep].write(1)
-					curFilePos += (1 if targetFilePos > curFilePos else -1)
-				if(curRankPos != targetRankPos):
-					board.digital[motorYStep].write(1)
-					curRankPos += (1 if targetRankPos > curRankPos else -1)
-				time.sleep(0.0015 if curMagnetState == 1 else 0.0001)
-	
-				board.digital[motorXStep].write(0)
-				board.digital[motorYStep].write(0)
-				board.digital[motorZStep].write(0)
+			delay = motion.step()
+			if(delay is None): # Plan carried out, prompt input
+				prompt_input()
+			elif(delay > 0):
+				time.sleep(delay)
+	finally:
+		dump_trace()
+		chess_algorithm.close_snapshot_channel(SNAPSHOT_CHANNEL)
+		chess_algorithm.archive_close()